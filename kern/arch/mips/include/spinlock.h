@@ -43,6 +43,12 @@ typedef unsigned spinlock_data_t;
 void spinlock_data_set(volatile spinlock_data_t *sd, unsigned val);
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+spinlock_data_t spinlock_data_fetchadd(volatile spinlock_data_t *sd,
+				       unsigned val);
+spinlock_data_t spinlock_data_swap(volatile spinlock_data_t *sd,
+				   spinlock_data_t val);
+spinlock_data_t spinlock_data_cas(volatile spinlock_data_t *sd,
+				  spinlock_data_t old, spinlock_data_t new);
 
 ////////////////////////////////////////////////////////////
 
@@ -93,5 +99,88 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+/*
+ * The rest are for the queueing spinlocks (see spinlock.c). Unlike
+ * testandset, which is allowed to fail spuriously, these retry the
+ * LL/SC until the store goes through.
+ */
+
+/* Atomically add VAL to *SD; return the old value. */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchadd(volatile spinlock_data_t *sd, unsigned val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"addu %1, %0, %3;"	/*   y = x + val */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (sd), "r" (val));
+	} while (y == 0);
+	return x;
+}
+
+/* Atomically store VAL in *SD; return the old value. */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_swap(volatile spinlock_data_t *sd, spinlock_data_t val)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"move %1, %3;"		/*   y = val */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (sd), "r" (val));
+	} while (y == 0);
+	return x;
+}
+
+/*
+ * Compare and swap: if *SD is OLD, atomically store NEW in it. Returns
+ * the value found, so it succeeded if that is OLD.
+ */
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_cas(volatile spinlock_data_t *sd,
+		  spinlock_data_t old, spinlock_data_t new)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	do {
+		/* If the comparison fails we skip the SC; y stays 1. */
+		y = 1;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			".set noreorder;"	/* we fill the delay slot */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"bne %0, %3, 1f;"	/*   if (x != old) goto 1 */
+			"nop;"			/*   (delay slot) */
+			"move %1, %4;"		/*   y = new */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			"1:"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y)
+			: "r" (sd), "r" (old), "r" (new));
+	} while (y == 0);
+	return x;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
@@ -35,6 +35,9 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <endian.h>
+#include <copyinout.h>
+#include <proc.h>
 
 /*
  * System call dispatcher.
@@ -107,6 +110,16 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_sched_setaffinity:
+		err = sys_sched_setaffinity((pid_t)tf->tf_a0,
+					    (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_sched_getaffinity:
+		err = sys_sched_getaffinity((pid_t)tf->tf_a0,
+					    (userptr_t)tf->tf_a1);
+		break;
 #ifdef UW
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
@@ -134,6 +147,89 @@ syscall(struct trapframe *tf)
 	case SYS_execv:
 	  err = sys_execv((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
 	  break;
+	case SYS_spawn:
+	  err = sys_spawn((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1,
+			  (pid_t *)&retval);
+	  break;
+#if OPT_A2
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0, (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2, &retval);
+	  break;
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			 (size_t)tf->tf_a2, &retval);
+	  break;
+	case SYS_readv:
+	  err = sys_readv((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2, &retval);
+	  break;
+	case SYS_writev:
+	  err = sys_writev((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2, &retval);
+	  break;
+	case SYS_copy_file_range:
+	  err = sys_copy_file_range((int)tf->tf_a0, (int)tf->tf_a1,
+				    (size_t)tf->tf_a2, &retval);
+	  break;
+	case SYS_pread:
+	case SYS_pwrite:
+	  /* The 64-bit offset doesn't fit in a3, so it's on the stack. */
+	  {
+	    uint32_t words[2];
+	    uint64_t pos;
+
+	    err = copyin((userptr_t)(tf->tf_sp + 16), words, sizeof(words));
+	    if (err) {
+	      break;
+	    }
+	    join32to64(words[0], words[1], &pos);
+	    if (callno == SYS_pread) {
+	      err = sys_pread((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			      (size_t)tf->tf_a2, (off_t)pos, &retval);
+	    }
+	    else {
+	      err = sys_pwrite((int)tf->tf_a0, (userptr_t)tf->tf_a1,
+			       (size_t)tf->tf_a2, (off_t)pos, &retval);
+	    }
+	  }
+	  break;
+	case SYS_lseek:
+	  /*
+	   * The offset is 64 bits, in a2/a3 (a1 is padding); whence is
+	   * on the stack. The 64-bit result goes back in v0/v1.
+	   */
+	  {
+	    uint64_t pos;
+	    int whence;
+	    off_t newpos;
+	    uint32_t hi, lo;
+
+	    join32to64(tf->tf_a2, tf->tf_a3, &pos);
+	    err = copyin((userptr_t)(tf->tf_sp + 16), &whence, sizeof(whence));
+	    if (err) {
+	      break;
+	    }
+	    err = sys_lseek((int)tf->tf_a0, (off_t)pos, whence, &newpos);
+	    if (err) {
+	      break;
+	    }
+	    split64to32((uint64_t)newpos, &hi, &lo);
+	    retval = hi;
+	    tf->tf_v1 = lo;
+	  }
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+	case SYS_dup2:
+	  err = sys_dup2((int)tf->tf_a0, (int)tf->tf_a1, &retval);
+	  break;
+	case SYS_fcntl:
+	  err = sys_fcntl((int)tf->tf_a0, (int)tf->tf_a1, (int)tf->tf_a2,
+			  &retval);
+	  break;
+#endif
 		
 #endif // UW
 
@@ -51,7 +51,7 @@
 /*
  * Wrap rma_stealmem in a spinlock.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static struct spinlock stealmem_lock = SPINLOCK_NAMED_INITIALIZER("stealmem");
 struct coremap {
 	paddr_t addr;
 	bool avail;
@@ -123,9 +123,9 @@ getppages(unsigned long npages)
 		core_map[lo_alloc].nblocks = n_pages;
 		addr = core_map[lo_alloc].addr;
 	} else {
-		kprintf("getppages failes\n");
+		/* 0 is never a valid frame; callers check for it */
 		spinlock_release(&stealmem_lock);
-		return ENOMEM;
+		return 0;
 	}
 	} else {
 		addr = ram_stealmem(npages);
@@ -146,10 +146,6 @@ alloc_kpages(int npages)
 	if (pa==0) {
 		return 0;
 	}
-#if OPT_A3
-	if (pa == ENOMEM)
-		return ENOMEM;
-#endif
 	return PADDR_TO_KVADDR(pa);
 
 }
@@ -160,16 +156,21 @@ free_kpages(vaddr_t addr)
 	/* nothing - leak the memory. */
 #if OPT_A3
 	KASSERT(addr);
+	/* kfree passes kseg0 addresses, as_destroy physical ones */
+	if (addr >= MIPS_KSEG0) {
+		KASSERT(addr < MIPS_KSEG1);
+		addr -= MIPS_KSEG0;
+	}
 	spinlock_acquire(&stealmem_lock);
 	if (bootstraped) {
-	int lo_free;
+	int lo_free = -1;
 	for (int i = 0; i < n_frames; ++i){
 		if (core_map[i].addr == addr) {
 			lo_free = i;
 			break;
 		}
 	}
-	if ((core_map[lo_free].nblocks == -1) || (core_map[lo_free].avail == true)){
+	if ((lo_free < 0) || (core_map[lo_free].nblocks == -1) || (core_map[lo_free].avail == true)){
 		spinlock_release(&stealmem_lock);
 		return;
 	}
@@ -185,17 +186,38 @@ free_kpages(vaddr_t addr)
 #endif
 }
 
+/*
+ * User mappings are never shot down under dumbvm; the only shootdowns
+ * come from freeing kseg2 memory (see kvmalloc.c). Flushing the whole
+ * TLB is always safe since everything just faults back in.
+ */
 void
 vm_tlbshootdown_all(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	int index, spl;
+
+	if (ts->ts_addrspace != NULL || !kvm_isaddr(ts->ts_vaddr)) {
+		panic("dumbvm tried to do tlb shootdown?!\n");
+	}
+
+	spl = splhigh();
+	index = tlb_probe(ts->ts_vaddr & TLBHI_VPAGE, 0);
+	if (index >= 0) {
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+	}
+	splx(spl);
 }
 
 int
@@ -208,6 +230,11 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	struct addrspace *as;
 	int spl;
 
+	/* Kernel allocations mapped in kseg2 don't belong to any process. */
+	if (kvm_isaddr(faultaddress)) {
+		return kvm_fault(faulttype, faultaddress);
+	}
+
 	faultaddress &= PAGE_FRAME;
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
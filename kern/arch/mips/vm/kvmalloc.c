@@ -0,0 +1,269 @@
+/*
+ * Virtually contiguous kernel allocations in kseg2.
+ *
+ * kmalloc hands multi-page requests to alloc_kpages, which needs a
+ * physically contiguous run of frames. Once physical memory is
+ * fragmented that fails even though plenty of single frames are free.
+ * When it does, kmalloc comes here instead: we grab the frames one at
+ * a time and map them at consecutive virtual pages in kseg2, which is
+ * TLB-mapped. Kernel TLB misses in that range are resolved by
+ * kvm_fault(), which the VM system's vm_fault must call first thing.
+ *
+ * The "page table" is a flat array with one entry per kseg2 page. Like
+ * the pageref table in kmalloc.c it lives in the BSS, since it cannot
+ * come from kmalloc itself. Each entry is the physical address of the
+ * frame plus two flag bits in the (otherwise unused) offset part.
+ *
+ * Freed virtual ranges are not reused right away: allocation is
+ * first-fit starting from a rotating hint. TLB shootdowns are
+ * asynchronous, so this keeps a CPU that has not yet processed the
+ * shootdown from seeing a stale translation for someone else's
+ * brand-new buffer.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <mips/tlb.h>
+#include <vm.h>
+
+/* 1024 pages (4M) of kseg2; the table itself is then exactly one page. */
+#define KVM_NPAGES	1024
+#define KVM_BASE	MIPS_KSEG2
+#define KVM_TOP		(KVM_BASE + KVM_NPAGES * PAGE_SIZE)
+
+#define KVM_INUSE	0x1	/* virtual page is allocated */
+#define KVM_LAST	0x2	/* last page of its allocation */
+
+#define KVM_PADDR(pte)	((pte) & PAGE_FRAME)
+#define KVM_INDEX(va)	(((va) - KVM_BASE) / PAGE_SIZE)
+#define KVM_VADDR(ix)	(KVM_BASE + (ix) * PAGE_SIZE)
+
+static paddr_t kvm_pte[KVM_NPAGES];
+static unsigned kvm_hint;
+
+/* Statistics, for kheap_printstats. */
+static unsigned kvm_pagesinuse;
+static unsigned kvm_allocs;
+static unsigned kvm_faults;
+
+static struct spinlock kvm_lock = SPINLOCK_NAMED_INITIALIZER("kvm");
+
+bool
+kvm_isaddr(vaddr_t addr)
+{
+	return addr >= KVM_BASE && addr < KVM_TOP;
+}
+
+/*
+ * Find and reserve NPAGES consecutive free virtual pages. Returns the
+ * index of the first one, or -1.
+ */
+static
+int
+kvm_reserve(unsigned npages)
+{
+	unsigned start, run, i, pass;
+
+	KASSERT(spinlock_do_i_hold(&kvm_lock));
+
+	/* Two passes: from the hint to the top, then from the bottom. */
+	for (pass = 0; pass < 2; pass++) {
+		start = (pass == 0) ? kvm_hint : 0;
+		run = 0;
+		for (i = start; i < KVM_NPAGES; i++) {
+			if (kvm_pte[i] & KVM_INUSE) {
+				run = 0;
+				continue;
+			}
+			if (++run == npages) {
+				start = i + 1 - npages;
+				for (i = start; i < start + npages; i++) {
+					kvm_pte[i] = KVM_INUSE;
+				}
+				kvm_pte[start + npages - 1] |= KVM_LAST;
+				kvm_hint = (start + npages) % KVM_NPAGES;
+				return start;
+			}
+		}
+	}
+	return -1;
+}
+
+/*
+ * Drop the translation for VADDR from this CPU's TLB, if present.
+ */
+static
+void
+kvm_tlb_invalidate(vaddr_t vaddr)
+{
+	int spl, index;
+
+	spl = splhigh();
+	index = tlb_probe(vaddr & TLBHI_VPAGE, 0);
+	if (index >= 0) {
+		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+	}
+	splx(spl);
+}
+
+/*
+ * Release the virtual pages FIRST..FIRST+NPAGES-1 and the frames behind
+ * them, and make sure no CPU keeps a translation for them.
+ */
+static
+void
+kvm_release(unsigned first, unsigned npages)
+{
+	struct tlbshootdown ts;
+	paddr_t pa;
+	unsigned i;
+
+	for (i = first; i < first + npages; i++) {
+		spinlock_acquire(&kvm_lock);
+		pa = KVM_PADDR(kvm_pte[i]);
+		kvm_pte[i] = 0;
+		if (pa != 0) {
+			kvm_pagesinuse--;
+		}
+		spinlock_release(&kvm_lock);
+
+		kvm_tlb_invalidate(KVM_VADDR(i));
+		ts.ts_addrspace = NULL;
+		ts.ts_vaddr = KVM_VADDR(i);
+		ipi_tlbshootdown_broadcast(&ts);
+
+		if (pa != 0) {
+			free_kpages(PADDR_TO_KVADDR(pa));
+		}
+	}
+}
+
+/*
+ * Allocate NPAGES pages of kseg2, backed by frames that need not be
+ * physically contiguous. Returns 0 if out of either frames or kseg2.
+ */
+vaddr_t
+alloc_kvpages(int npages)
+{
+	vaddr_t frame;
+	int first, i;
+
+	KASSERT(npages > 0);
+
+	spinlock_acquire(&kvm_lock);
+	first = kvm_reserve(npages);
+	spinlock_release(&kvm_lock);
+	if (first < 0) {
+		kprintf("kmalloc: kseg2 exhausted (%d pages wanted)\n",
+			npages);
+		return 0;
+	}
+
+	/*
+	 * Get the frames without holding kvm_lock; alloc_kpages takes
+	 * its own lock and may print.
+	 */
+	for (i = 0; i < npages; i++) {
+		frame = alloc_kpages(1);
+		if (frame == 0) {
+			kvm_release(first, npages);
+			return 0;
+		}
+		spinlock_acquire(&kvm_lock);
+		KASSERT(kvm_pte[first + i] & KVM_INUSE);
+		kvm_pte[first + i] |= (frame - MIPS_KSEG0) & PAGE_FRAME;
+		kvm_pagesinuse++;
+		spinlock_release(&kvm_lock);
+	}
+
+	spinlock_acquire(&kvm_lock);
+	kvm_allocs++;
+	spinlock_release(&kvm_lock);
+
+	return KVM_VADDR(first);
+}
+
+/*
+ * Free an allocation made by alloc_kvpages.
+ */
+void
+free_kvpages(vaddr_t addr)
+{
+	unsigned first, last;
+
+	KASSERT(kvm_isaddr(addr));
+	KASSERT((addr & PAGE_FRAME) == addr);
+
+	first = KVM_INDEX(addr);
+
+	spinlock_acquire(&kvm_lock);
+	if ((kvm_pte[first] & KVM_INUSE) == 0) {
+		panic("kfree: kseg2 address %p is not allocated\n",
+		      (void *)addr);
+	}
+	for (last = first; (kvm_pte[last] & KVM_LAST) == 0; last++) {
+		KASSERT(last + 1 < KVM_NPAGES);
+		KASSERT(kvm_pte[last + 1] & KVM_INUSE);
+	}
+	spinlock_release(&kvm_lock);
+
+	/* Nobody else may touch the range until we've finished freeing it. */
+	kvm_release(first, last - first + 1);
+}
+
+/*
+ * Handle a TLB miss on a kseg2 address. Returns 0 if the translation
+ * was loaded, EFAULT if the address is not mapped.
+ *
+ * This may be called in interrupt context or with spinlocks held, so
+ * it must not sleep; it only takes kvm_lock, which is never held
+ * while touching kseg2 memory.
+ */
+int
+kvm_fault(int faulttype, vaddr_t faultaddress)
+{
+	paddr_t pa;
+	uint32_t ehi, elo;
+	int spl;
+
+	KASSERT(kvm_isaddr(faultaddress));
+
+	if (faulttype == VM_FAULT_READONLY) {
+		/* kseg2 pages are always mapped writeable */
+		return EFAULT;
+	}
+
+	faultaddress &= PAGE_FRAME;
+
+	spinlock_acquire(&kvm_lock);
+	pa = KVM_PADDR(kvm_pte[KVM_INDEX(faultaddress)]);
+	kvm_faults++;
+	spinlock_release(&kvm_lock);
+
+	if (pa == 0) {
+		return EFAULT;
+	}
+
+	ehi = faultaddress;
+	elo = pa | TLBLO_DIRTY | TLBLO_VALID;
+
+	spl = splhigh();
+	tlb_random(ehi, elo);
+	splx(spl);
+
+	return 0;
+}
+
+void
+kvm_printstats(void)
+{
+	spinlock_acquire(&kvm_lock);
+	kprintf("kseg2 allocator: %u/%u pages in use, "
+		"%u allocations, %u TLB refills\n",
+		kvm_pagesinuse, (unsigned)KVM_NPAGES, kvm_allocs, kvm_faults);
+	spinlock_release(&kvm_lock);
+}
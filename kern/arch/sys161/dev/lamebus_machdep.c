@@ -50,6 +50,10 @@
  */
 #define CPU_FREQUENCY 25000000 /* 25 MHz */
 
+/* Cycles per hardclock, and the most hardclocks one timer interval can span */
+#define TIMER_PERIOD	(CPU_FREQUENCY / HZ)
+#define TIMER_MAXTICKS	(0xffffffffU / TIMER_PERIOD)
+
 /*
  * Access to the on-chip timer.
  *
@@ -73,6 +77,26 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read c0_count. Writing c0_compare resets it on System/161, so this
+ * is the number of cycles since the timer was last set.
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -113,7 +137,7 @@ mainbus_bootstrap(void)
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mips_timer_set(TIMER_PERIOD);
 }
 
 /*
@@ -242,6 +266,37 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Dynamic ticks. The timer interrupt handler below always resets the
+ * timer to one hardclock period, so deferring is just a matter of
+ * setting a longer interval once. The count register wraps after
+ * 2^32 cycles, which bounds how far we can defer (TIMER_MAXTICKS).
+ */
+void
+mainbus_timer_defer(unsigned ticks)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(ticks > 0);
+
+	if (ticks > TIMER_MAXTICKS) {
+		ticks = TIMER_MAXTICKS;
+	}
+	mips_timer_set(ticks * TIMER_PERIOD);
+}
+
+unsigned
+mainbus_timer_resume(void)
+{
+	uint32_t count;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	/* Keep the tick phase: fire at the end of the current period. */
+	count = mips_timer_get();
+	mips_timer_set(TIMER_PERIOD - count % TIMER_PERIOD);
+	return count / TIMER_PERIOD;
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -269,7 +324,7 @@ mainbus_interrupt(struct trapframe *tf)
 	}
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		mips_timer_set(TIMER_PERIOD);
 		/* and call hardclock */
 		hardclock();
 	}
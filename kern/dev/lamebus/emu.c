@@ -653,6 +653,7 @@ emufs_stat(struct vnode *v, struct stat *statbuf)
 	statbuf->st_mode |= 0644; /* possibly a lie */
 	statbuf->st_nlink = 1;    /* might be a lie, but doesn't matter much */
 	statbuf->st_blocks = 0;   /* almost certainly a lie */
+	statbuf->st_blksize = EMU_MAXIO; /* largest single transfer */
 
 	return 0;
 }
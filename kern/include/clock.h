@@ -38,8 +38,8 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU every timer tick (LT_GRANULARITY
+ * usec) to run callouts; see below.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -61,17 +61,56 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 void timerclock(void);
 
+/*
+ * Called from the idle loop, at splhigh, instead of cpu_idle(). If
+ * the cpu has no periodic work for the next MAXTICKS hardclocks, the
+ * timer is reprogrammed so those ticks are never taken; an IPI or
+ * device interrupt still wakes the cpu, and the skipped ticks are
+ * credited to c_hardclocks either way.
+ */
+void hardclock_idle(unsigned maxticks);
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
 
+/*
+ * Callouts: run a function after a given number of timer ticks.
+ *
+ * Ticks are timer ticks, one every LT_GRANULARITY usec (see
+ * kern/dev/ltimer.h). A struct callout may be embedded anywhere; it
+ * is initialized once with callout_init and then (re)armed with
+ * callout_schedule, which replaces any pending expiry. callout_stop
+ * disarms it and returns true if it was still pending, which includes
+ * being due this tick with its handler not yet started.
+ *
+ * The function runs in interrupt context, on whichever cpu takes the
+ * timer interrupt, so it must not sleep. It is called with the
+ * callout already disarmed, so it may rearm it. callout_stop cannot
+ * wait for a handler that has already started; if the caller is about
+ * to free the callout it must synchronize with the handler itself.
+ */
+struct callout {
+	struct callout *co_next;	/* Link in wheel slot or due list */
+	struct callout **co_prevp;	/* Back link, for removal */
+	unsigned co_expire;		/* Tick at which to fire */
+	bool co_pending;		/* On the wheel, or due but not run */
+	void (*co_func)(void *);	/* Handler */
+	void *co_arg;			/* Argument for handler */
+};
+
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+void callout_schedule(struct callout *co, unsigned ticks);
+bool callout_stop(struct callout *co);
+
+/* Number of timer ticks since boot. */
+unsigned callout_ticks(void);
+
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
- *
- *  this will be more efficient than clocknap() for longer sleeps
  */
 void clocksleep(int seconds);
 
@@ -34,8 +34,19 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-schedtrace.h"
+#if OPT_SCHEDTRACE
+#include <schedtrace.h>
+#endif
 
 
+/*
+ * Number of run queue levels for the multi-level feedback queue
+ * scheduler. Level 0 is the highest priority. See schedule() in
+ * thread.c.
+ */
+#define SCHED_NLEVELS	4
+
 /*
  * Per-cpu structure
  *
@@ -60,15 +71,47 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_steal_attempts;	/* Work stealing attempts */
+	unsigned c_steal_failures;	/* ...that found nothing to take */
+	unsigned c_steal_backoff;	/* Hardclocks to wait after failing */
+	unsigned c_steal_next;		/* Don't try again before this */
+	struct threadlist c_threadcache; /* Dead threads kept for reuse */
+	unsigned c_tcache_hits;		/* thread_fork reused a thread */
+	unsigned c_tcache_misses;	/* thread_fork had to allocate */
+	unsigned c_tcache_overflows;	/* Cache full, thread freed */
+	unsigned c_tickless;		/* Hardclocks deferred, or 0 */
+	unsigned c_idle_ticks;		/* Hardclock periods spent idle */
+	unsigned c_ticks_suppressed;	/* ...whose interrupt was skipped */
+#if OPT_MCSLOCK
+	struct mcsnode c_mcsnodes[MCS_NODES]; /* For spinlock.c */
+	uint32_t c_mcsfree;		/* Bitmap of free c_mcsnodes */
+#endif
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues, by level */
+	struct threadlist c_evicted;	/* Ready threads barred from here */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Scheduler statistics.
+	 * Also protected by the runqueue lock.
+	 */
+	unsigned c_rq_maxlen[SCHED_NLEVELS];	/* Longest each queue got */
+	unsigned c_rq_enqueued[SCHED_NLEVELS];	/* Threads queued per level */
+	unsigned c_sched_demotions;	/* Quantum used up, moved down */
+	unsigned c_sched_boosts;	/* Woken from sleep, moved up */
+	unsigned c_sched_promotions;	/* Waited too long, moved up */
+	unsigned c_migrations_in;	/* Threads stolen by this cpu */
+	unsigned c_migrations_out;	/* Threads stolen from this cpu */
+	unsigned c_yields_skipped;	/* Quantum up, but nobody to run */
+#if OPT_SCHEDTRACE
+	struct schedtrace c_schedtrace;	/* Latency histograms */
+#endif
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -152,6 +195,7 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends that to all CPUs except the current one.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +210,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,81 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+/*
+ * Open files and per-process file tables.
+ *
+ * An openfile is what open() makes: a vnode, the access mode it was
+ * opened with, and the seek position. It is reference counted, since
+ * fork, spawn and dup2 share one openfile between several file
+ * descriptors (and processes), which then share its offset. While it
+ * is shared, the offset is protected by of_offsetlock, which is held
+ * across each read, write or seek so that those are atomic with
+ * respect to each other. With only one reference nobody else can
+ * move the offset, so the lock isn't taken.
+ *
+ * A filetable maps file descriptors to openfiles, with the per-fd
+ * flags (FD_CLOEXEC). Each process has its own, used only by its own
+ * thread, so it has no lock of its own; openfiles taken from it stay
+ * valid at least until the same process changes that descriptor.
+ *
+ * Functions:
+ *     openfile_open    - vfs_open PATH with FLAGS and MODE, and make an
+ *                        openfile with one reference. PATH may be
+ *                        destroyed.
+ *     openfile_incref  - Add a reference.
+ *     openfile_decref  - Drop a reference; closes the file on the last.
+ *
+ *     filetable_create  - Make an empty table. Returns NULL if out of
+ *                         memory.
+ *     filetable_copy    - Make a table sharing all of SRC's openfiles.
+ *     filetable_destroy - Close everything and free the table.
+ *     filetable_get     - Look up FD; EBADF if it isn't open.
+ *     filetable_place   - Put OF (taking over its reference) at the
+ *                         lowest free fd; EMFILE if there is none.
+ *     filetable_placeat - Put OF at FD, returning whatever was there
+ *                         (or NULL) in OLDOF for the caller to drop.
+ *     filetable_remove  - Take FD out of the table and return its
+ *                         openfile (whose reference the caller now
+ *                         owns); EBADF if it isn't open.
+ *     filetable_getflags/setflags - Per-fd flags.
+ *     filetable_closeexec - Close every fd marked FD_CLOEXEC.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY or O_RDWR */
+	bool of_append;			/* O_APPEND: writes go at EOF */
+	struct lock *of_offsetlock;
+	off_t of_offset;
+	struct spinlock of_reflock;
+	unsigned of_refcount;
+};
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+	int ft_flags[OPEN_MAX];		/* FD_CLOEXEC */
+};
+
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable *filetable_create(void);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+void filetable_destroy(struct filetable *ft);
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+int filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		      struct openfile **oldof);
+int filetable_remove(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_getflags(struct filetable *ft, int fd, int *flags);
+int filetable_setflags(struct filetable *ft, int fd, int flags);
+void filetable_closeexec(struct filetable *ft);
+
+#endif /* _FILETABLE_H_ */
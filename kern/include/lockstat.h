@@ -0,0 +1,58 @@
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics ("options lockstat").
+ *
+ * When enabled (from the kernel menu), spinlocks, locks and CVs record
+ * how often they are acquired, how often that meant waiting, and how
+ * long they were waited for and held. Statistics are kept per lock
+ * name, so e.g. all the "runqueue" spinlocks or all the locks created
+ * as "testlock" add up together. Spinlocks that were never given a
+ * name are grouped by the code that acquired them.
+ *
+ * Times are in nanoseconds, from the realtime clock on the timer
+ * device, which counts individual processor cycles.
+ *
+ * Each lock caches a pointer to its record, which is looked up by
+ * lockstat_get the first time it's needed; records are never freed.
+ *
+ * These functions must not use spinlocks themselves (spinlock_acquire
+ * calls them) and so they don't; they must be called with interrupts
+ * off if the caller holds a spinlock.
+ */
+
+#define LOCKSTAT_SPINLOCK	0
+#define LOCKSTAT_LOCK		1
+#define LOCKSTAT_CV		2
+
+struct lockstat;	/* Opaque */
+
+/* True while statistics are being collected. */
+extern volatile bool lockstat_enabled;
+
+/* Current time, in nanoseconds. Only call while lockstat_enabled. */
+uint64_t lockstat_now(void);
+
+/*
+ * Find (or make) the record for a lock of kind KIND called NAME. If
+ * NAME is NULL, CALLER identifies it instead. Returns NULL if the
+ * table is full.
+ */
+struct lockstat *lockstat_get(unsigned kind, const char *name,
+			      vaddr_t caller);
+
+/* Record an acquisition, which waited WAITNS if CONTENDED. */
+void lockstat_acquired(struct lockstat *ls, bool contended, uint64_t waitns);
+
+/* Record a release, after holding for HOLDNS. */
+void lockstat_released(struct lockstat *ls, uint64_t holdns);
+
+/* Turn collection on or off; throw away what's been collected. */
+void lockstat_enable(bool on);
+void lockstat_reset(void);
+
+/* Print everything, the most-waited-for locks first. */
+void lockstat_print(void);
+
+#endif /* _LOCKSTAT_H_ */
@@ -55,6 +55,17 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Dynamic ticks for the current cpu's hardclock timer.
+ * mainbus_timer_defer makes the next timer interrupt come TICKS
+ * hardclock periods from now instead of one; the interrupt itself puts
+ * the timer back to the regular period. mainbus_timer_resume does that
+ * early (after some other interrupt) and returns how many whole
+ * periods went by since the defer.
+ */
+void mainbus_timer_defer(unsigned ticks);
+unsigned mainbus_timer_resume(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
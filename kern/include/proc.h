@@ -40,9 +40,11 @@
 #include <thread.h> /* required for struct threadarray */
 #include <opt-A2.h>
 #include <array.h>
+#include "opt-schedtrace.h"
 
 struct addrspace;
 struct vnode;
+struct filetable;
 #ifdef UW
 struct semaphore;
 #endif // UW
@@ -74,6 +76,12 @@ struct proc {
 #ifdef OPT_A2
     pid_t pid;
 #endif
+#if OPT_A2
+	struct filetable *p_filetable;	/* open files */
+#endif
+#if OPT_SCHEDTRACE
+	struct schedtrace_proc *p_schedtrace;	/* Latency histograms */
+#endif
     
 };
 
@@ -107,21 +115,28 @@ struct addrspace *curproc_getas(void);
 struct addrspace *curproc_setas(struct addrspace *);
 
 #if OPT_A2
-extern pid_t A2_HIGHEST_PID;
-extern pid_t A2_MAX_PID;
-struct array* pid_pool;
-struct lock* pid_pool_lock;
 struct lock* proc_table_lock;
-enum proc_state {PROC_RUNNING, PROC_EXITED, PROC_ZOMBIE};
+enum proc_state {PROC_RUNNING, PROC_ZOMBIE};
+// one per process, from creation until it has exited and nobody can wait for
+// it any more; indexed by pid. protected by proc_table_lock.
 struct proc_table {
 	pid_t pid;
 	pid_t ppid; // ppid for parent pid, -1 for global parent process
 	enum proc_state state;
 	int exitcode;
+	struct proc_table* parent; // NULL if ppid is -1
+	struct proc_table* children; // first child; zombies come first
+	struct proc_table* children_tail; // last child
+	struct proc_table* next_sibling; // parent's other children
+	struct proc_table* prev_sibling;
+	struct cv* wait_cv; // waitpid sleeps here for a child to exit
 };
-struct array* proc_tables;
 struct proc_table* find_proc_table(pid_t pid);
-struct cv* proc_table_cv;
+struct proc_table* add_proc_table(void);
+void set_proc_parent(struct proc_table* pt, struct proc_table* ppt);
+void mark_proc_zombie(struct proc_table* pt);
+void orphan_proc_children(struct proc_table* ppt);
+void reap_proc_table(struct proc_table* pt);
 #endif
 
 #endif /* _PROC_H_ */
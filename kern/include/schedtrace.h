@@ -0,0 +1,68 @@
+#ifndef _SCHEDTRACE_H_
+#define _SCHEDTRACE_H_
+
+/*
+ * Scheduler latency tracing ("options schedtrace").
+ *
+ * When enabled (from the kernel menu), the scheduler timestamps each
+ * thread as it is put on a run queue (thread_make_runnable) and as it
+ * starts and stops running (thread_switch). From these it keeps two
+ * histograms, for each cpu and for each process:
+ *
+ *   wait	time from being made runnable to running (wakeup
+ *		latency, or how long a preempted thread sat queued)
+ *   slice	time run before switching away
+ *
+ * Buckets are powers of two in microseconds. Times come from the
+ * realtime clock on the timer device, which counts processor cycles.
+ *
+ * The per-cpu histograms live in struct cpu and are protected by its
+ * runqueue lock. Per-process ones live in a fixed table here, so that
+ * they survive the process for printing; a process's entry is only
+ * recycled for a new one when the table runs out.
+ */
+
+#define SCHEDHIST_BUCKETS	24	/* <1us, 1-2us, ... ~4s and up */
+
+struct schedhist {
+	unsigned sh_count;
+	uint64_t sh_totalns;
+	uint64_t sh_maxns;
+	unsigned sh_buckets[SCHEDHIST_BUCKETS];
+};
+
+struct schedtrace {
+	struct schedhist st_wait;	/* Runnable to running */
+	struct schedhist st_slice;	/* Running to switched out */
+};
+
+struct schedtrace_proc;		/* Opaque; per-process entry */
+
+/* True while tracing. */
+extern volatile bool schedtrace_enabled;
+
+/* Current time in nanoseconds. Only call while schedtrace_enabled. */
+uint64_t schedtrace_now(void);
+
+/* Clear, add a sample to, and print histograms. */
+void schedtrace_clear(struct schedtrace *st);
+void schedhist_add(struct schedhist *sh, uint64_t ns);
+void schedtrace_print(const struct schedtrace *st);
+
+/*
+ * Per-process entries. procalloc returns NULL if the table is full
+ * of live processes; procfree marks the process exited. procrecord
+ * adds a sample for SP (which may be NULL); call it with interrupts
+ * off.
+ */
+struct schedtrace_proc *schedtrace_procalloc(const char *name, pid_t pid);
+void schedtrace_procfree(struct schedtrace_proc *sp);
+void schedtrace_procrecord(struct schedtrace_proc *sp, bool slice,
+			   uint64_t ns);
+
+/* Turn tracing on or off; throw away the per-process data; print it. */
+void schedtrace_enable(bool on);
+void schedtrace_procreset(void);
+void schedtrace_procprint(void);
+
+#endif /* _SCHEDTRACE_H_ */
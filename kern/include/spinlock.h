@@ -45,6 +45,14 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+#include "opt-ticketlock.h"
+#include "opt-mcslock.h"
+#include "opt-lockstat.h"
+
+#if OPT_TICKETLOCK && OPT_MCSLOCK
+#error "options ticketlock and mcslock are mutually exclusive"
+#endif
+
 /*
  * Basic spinlock.
  *
@@ -53,16 +61,66 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * There are three implementations, chosen by kernel config (see
+ * spinlock.c): plain test-and-test-and-set, or, with "options
+ * ticketlock" or "options mcslock", one of two fair FIFO queue locks.
  */
+#if OPT_MCSLOCK
+/* A cpu's place in line for an MCS lock. */
+struct mcsnode {
+	volatile spinlock_data_t mn_next; /* Node queued behind us, or 0 */
+	volatile spinlock_data_t mn_wait; /* Nonzero until it's our turn */
+};
+
+/* How many MCS spinlocks one cpu can hold (or wait for) at once */
+#define MCS_NODES	16
+#endif
+
 struct spinlock {
+#if OPT_TICKETLOCK
+	volatile spinlock_data_t lk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket allowed in now. */
+#elif OPT_MCSLOCK
+	volatile spinlock_data_t lk_tail; /* Last node in line, or 0. */
+	struct mcsnode *lk_node;	/* Holder's node. */
+#else
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+#endif
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	const char *lk_name;		/* Name for lockstat, or NULL. */
+	struct lockstat *lk_stat;	/* Statistics record. */
+	uint64_t lk_acqtime;		/* When acquired, if timing. */
+#endif
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or
+ * global. The name is only used by lockstat.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_STATINIT(name)	, name, NULL, 0
+#else
+#define SPINLOCK_STATINIT(name)
+#endif
+
+#if OPT_TICKETLOCK
+#define SPINLOCK_NAMED_INITIALIZER(name)	\
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL \
+	  SPINLOCK_STATINIT(name) }
+#define SPINLOCK_KIND		"ticket"
+#elif OPT_MCSLOCK
+#define SPINLOCK_NAMED_INITIALIZER(name)	\
+	{ SPINLOCK_DATA_INITIALIZER, NULL, NULL SPINLOCK_STATINIT(name) }
+#define SPINLOCK_KIND		"MCS"
+#else
+#define SPINLOCK_NAMED_INITIALIZER(name)	\
+	{ SPINLOCK_DATA_INITIALIZER, NULL SPINLOCK_STATINIT(name) }
+#define SPINLOCK_KIND		"test-and-test-and-set"
+#endif
+
+#define SPINLOCK_INITIALIZER	SPINLOCK_NAMED_INITIALIZER(NULL)
 
 /*
  * Spinlock functions.
@@ -74,6 +132,11 @@ struct spinlock {
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * setname	Name the lock for lockstat, which adds together all the
+ *		spinlocks with the same name. NAME must stay valid as
+ *		long as the lock does. Unnamed spinlocks are listed
+ *		under the code that first acquired them.
  */
 
 void spinlock_init(struct spinlock *lk);
@@ -84,5 +147,11 @@ void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+#if OPT_LOCKSTAT
+void spinlock_setname(struct spinlock *lk, const char *name);
+#else
+#define spinlock_setname(lk, name)	((void)(lk), (void)(name))
+#endif
+
 
 #endif /* _SPINLOCK_H_ */
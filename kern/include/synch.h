@@ -79,6 +79,15 @@ struct lock {
         struct wchan *wc;
     struct spinlock sl;
     struct thread volatile *holder;
+        unsigned lk_prio;		/* Best level waiting; see synch.c */
+        struct lock *lk_nextheld;	/* Holder's t_heldlocks chain */
+        unsigned lk_acquires;		/* Statistics; protected by sl */
+        unsigned lk_spins;		/* ...got it by spinning */
+        unsigned lk_sleeps;		/* ...had to sleep */
+#if OPT_LOCKSTAT
+        struct lockstat *lk_stat;	/* Contention statistics */
+        uint64_t lk_acqtime;		/* When acquired, if timing */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -94,10 +103,13 @@ void lock_acquire(struct lock *);
  *                   false otherwise.
  *
  * These operations must be atomic. You get to write them.
+ *
+ *    lock_printstats - Print how many acquisitions had to spin or sleep.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
+void lock_printstats(struct lock *);
 
 
 /*
@@ -119,6 +131,12 @@ struct cv {
         // add what you need here
         // (don't forget to mark things volatile as needed)
         struct wchan *wc;
+        unsigned cv_signals;		/* Statistics; protected by the */
+        unsigned cv_broadcasts;		/* lock used with the CV */
+        unsigned cv_morphs;		/* Waiters requeued onto the lock */
+#if OPT_LOCKSTAT
+        struct lockstat *cv_stat;	/* Wait statistics */
+#endif
 };
 
 struct cv *cv_create(const char *name);
@@ -136,10 +154,69 @@ void cv_destroy(struct cv *);
  * on all operations with any particular CV.
  *
  * These operations must be atomic. You get to write them.
+ *
+ * Woken threads are moved straight onto the lock's wait queue rather
+ * than being made runnable only to block on the lock again.
+ * cv_printstats reports how often that happened.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
+void cv_printstats(struct cv *cv);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting, new readers block
+ * until it has been and gone, so a stream of readers can't starve it.
+ * (The flip side is that a thread that already holds the lock for
+ * reading must not acquire it for reading again; if a writer arrives
+ * in between, that deadlocks.)
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct spinlock rw_lock;
+	struct wchan *rw_readwchan;	/* Readers wait here */
+	struct wchan *rw_writewchan;	/* Writers and upgraders wait here */
+	volatile unsigned rw_readers;	/* Readers holding the lock */
+	volatile unsigned rw_writewait;	/* Writers waiting */
+	volatile bool rw_upgrading;	/* A reader is waiting to upgrade */
+	struct thread *rw_writer;	/* Writer holding the lock, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Give up the write hold.
+ *    rwlock_upgrade       - Turn a read hold into the write hold. Only
+ *                           one reader can be upgrading at a time; if
+ *                           another one already is, the read hold is
+ *                           dropped and the lock is acquired for
+ *                           writing from scratch, and false is returned
+ *                           so the caller knows to revalidate whatever
+ *                           it read. Otherwise returns true.
+ *    rwlock_downgrade     - Turn the write hold into a read hold,
+ *                           without letting any writer in between.
+ *    rwlock_do_i_write    - Return true if the current thread holds
+ *                           the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_upgrade(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
+bool rwlock_do_i_write(struct rwlock *);
 
 
 #endif /* _SYNCH_H_ */
@@ -58,6 +58,8 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_sched_setaffinity(pid_t pid, userptr_t user_mask);
+int sys_sched_getaffinity(pid_t pid, userptr_t user_mask);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -66,6 +68,20 @@ int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 int sys_fork(pid_t* retval, struct trapframe *tf);
 int sys_execv(userptr_t program, userptr_t args);
+int sys_spawn(userptr_t program, userptr_t args, pid_t *retval);
+int sys_open(userptr_t upath, int flags, mode_t mode, int *retval);
+int sys_read(int fdesc, userptr_t ubuf, size_t nbytes, int *retval);
+int sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos,
+	      int *retval);
+int sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos,
+	       int *retval);
+int sys_readv(int fdesc, userptr_t uiov, int iovcnt, int *retval);
+int sys_writev(int fdesc, userptr_t uiov, int iovcnt, int *retval);
+int sys_copy_file_range(int infd, int outfd, size_t len, int *retval);
+int sys_lseek(int fdesc, off_t pos, int whence, off_t *retval);
+int sys_close(int fdesc);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_fcntl(int fdesc, int cmd, int arg, int *retval);
 #endif // UW
 
 #endif /* _SYSCALL_H_ */
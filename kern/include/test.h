@@ -60,6 +60,10 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int pitest(int, char **);
+int spinlocktest(int, char **);
+int callouttest(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -39,8 +39,10 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include "opt-schedtrace.h"
 
 struct cpu;
+struct lock;
 
 /* get machine-dependent defs */
 #include <machine/thread.h>
@@ -83,6 +85,7 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	struct wchan *t_napchan;	/* Private channel for clocknap */
 
 	/*
 	 * Interrupt state fields.
@@ -101,6 +104,30 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields. While the thread is on a run queue these
+	 * are protected by that cpu's runqueue lock.
+	 */
+	unsigned t_priority;		/* Run queue level; 0 is highest */
+	unsigned t_inherit;		/* Level lent through held locks */
+	unsigned t_quantum_used;	/* Hardclocks used of this quantum */
+	unsigned t_rq_stamp;		/* c_hardclocks when last queued */
+	unsigned t_lastrun;		/* c_hardclocks when last on cpu */
+	bool t_onrunqueue;		/* On one of t_cpu's c_runqueue lists */
+	uint32_t t_cpumask;		/* Cpus allowed, by c_number */
+#if OPT_SCHEDTRACE
+	uint64_t t_rq_ns;		/* When made runnable, or 0 */
+	uint64_t t_run_ns;		/* When it started running, or 0 */
+#endif
+
+	/*
+	 * Priority inheritance (see synch.c). t_blocked_on is protected
+	 * by the inheritance lock there; t_heldlocks is only touched by
+	 * the thread itself.
+	 */
+	struct lock *t_blocked_on;	/* Lock we're asleep waiting for */
+	struct lock *t_heldlocks;	/* Locks we hold, via lk_nextheld */
+
 	/*
 	 * Public fields
 	 */
@@ -108,6 +135,9 @@ struct thread {
 	/* add more here as needed */
 };
 
+/* t_inherit (and lk_prio) when no priority is being lent */
+#define SCHED_NOPRIO	((unsigned)-1)
+
 /*
  * Array of threads.
  */
@@ -162,6 +192,53 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Scheduling priority.
+ *
+ * thread_priority returns the level T is scheduled at: its own, or the
+ * one lent to it through a lock it holds, whichever is higher.
+ * thread_set_inherited changes the lent level (SCHED_NOPRIO for none)
+ * and requeues T if needed. thread_setpriority moves the current
+ * thread to the given level; it is meant for tests, as the scheduler
+ * will move it again as usual.
+ */
+unsigned thread_priority(struct thread *t);
+void thread_set_inherited(struct thread *t, unsigned level);
+void thread_setpriority(unsigned level);
+
+/*
+ * CPU affinity. A thread only runs on the cpus whose bits (1 << cpu
+ * number) are set in its mask; new threads inherit their creator's.
+ * thread_setaffinity sets the current thread's mask, ignoring cpus
+ * that don't exist, and moves it off the current cpu if that's no
+ * longer allowed. It fails with EINVAL if no cpu would be left.
+ */
+#define CPUMASK_ALL	0xffffffffU
+
+uint32_t thread_getaffinity(void);
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Charge the current thread for one hardclock and yield if its time
+ * slice is used up or a higher-priority thread is waiting. Called
+ * from the timer interrupt.
+ */
+void thread_timeslice(void);
+
+/*
+ * Print per-cpu scheduler statistics (run queue lengths by level).
+ */
+void sched_printstats(void);
+
+#if OPT_SCHEDTRACE
+/*
+ * Print or clear the scheduler latency histograms, per cpu and per
+ * process. See schedtrace.h.
+ */
+void sched_printtrace(void);
+void sched_resettrace(void);
+#endif
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
@@ -55,6 +55,18 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Allocate/free kernel pages that are virtually but not necessarily
+ * physically contiguous (mapped in kseg2 on mips). kmalloc falls back
+ * on these when alloc_kpages cannot find a contiguous run of frames.
+ * vm_fault must hand kernel faults on such addresses to kvm_fault.
+ */
+vaddr_t alloc_kvpages(int npages);
+void free_kvpages(vaddr_t addr);
+bool kvm_isaddr(vaddr_t addr);
+int kvm_fault(int faulttype, vaddr_t faultaddress);
+void kvm_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
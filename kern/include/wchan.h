@@ -81,5 +81,21 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Move the first thread (or, if ALL, every thread) sleeping on FROM to
+ * the end of TO's queue, without waking it. Returns how many were
+ * moved. Neither queue should already be locked; FROM is locked before
+ * TO, so callers must always requeue in the same direction between
+ * any two channels (for CVs: from the CV to its lock).
+ */
+unsigned wchan_requeue(struct wchan *from, struct wchan *to, bool all);
+
+/*
+ * Return the best (numerically lowest) scheduling level of the threads
+ * sleeping on the channel, or SCHED_NOPRIO if there are none. Used for
+ * priority inheritance. The queue should not already be locked.
+ */
+unsigned wchan_priority(struct wchan *wc);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,61 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Deferred work.
+ *
+ * Each cpu has a worker thread (in kproc) that runs the work items
+ * queued to it, in order, one at a time, with interrupts on and no
+ * locks held. This is for getting work out of interrupt handlers,
+ * which can't sleep, and off latency-critical paths such as exit.
+ *
+ * A work item is a struct work, normally embedded in whatever it
+ * works on; it is set up once with work_init and can then be queued
+ * any number of times, but is only ever on one queue at once.
+ *
+ * Functions:
+ *     work_init       - Set up W to call FUNC(DATA1, DATA2).
+ *     work_queue      - Queue W on the current cpu. Returns false (and
+ *                       does nothing) if it's already queued. May be
+ *                       called from an interrupt handler.
+ *     work_queue_on   - Same, but on cpu number CPUNUM.
+ *     work_cancel     - Take W off its queue if it hasn't started yet.
+ *                       Returns true if it was taken off. If W is
+ *                       running it's left to finish; use work_flush
+ *                       to wait for it.
+ *     work_flush      - Wait until W is neither queued nor running.
+ *                       W's function may free W when it's done with
+ *                       it, so don't flush such items.
+ *     workqueue_flush - Wait until everything queued anywhere before
+ *                       the call has run.
+ *
+ * The flush functions sleep, so can't be used from interrupt handlers
+ * or from a work function (they'd wait for themselves).
+ *
+ * Each cpu calls workqueue_startcpu as it starts up, to create its
+ * queue and worker; nothing can be queued on a cpu before that.
+ */
+
+struct workqueue;	/* Opaque; one per cpu */
+
+struct work {
+	void (*w_func)(void *data1, unsigned long data2);
+	void *w_data1;
+	unsigned long w_data2;
+	struct work *w_next;		/* Next on the queue */
+	struct workqueue *w_wq;		/* Queue it's on, or last ran on */
+	unsigned w_seq;			/* Order queued, for flushing */
+	bool w_pending;			/* On the queue now */
+};
+
+void work_init(struct work *w, void (*func)(void *, unsigned long),
+	       void *data1, unsigned long data2);
+bool work_queue(struct work *w);
+bool work_queue_on(struct work *w, unsigned cpunum);
+bool work_cancel(struct work *w);
+void work_flush(struct work *w);
+void workqueue_flush(void);
+
+void workqueue_startcpu(void);
+
+#endif /* _WORKQUEUE_H_ */
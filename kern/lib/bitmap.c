@@ -120,6 +120,43 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Same, but search from bit START onward, wrapping around to the
+ * beginning, so that callers can hand bits out in rotation.
+ */
+int
+bitmap_alloc_from(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned ix, i;
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned offset;
+
+        if (start >= b->nbits) {
+                start = 0;
+        }
+        ix = start / BITS_PER_WORD;
+        offset = start % BITS_PER_WORD;
+
+        /* One extra step, for the bits in START's word before START */
+        for (i=0; i<=maxix; i++) {
+                if (b->v[ix]!=WORD_ALLBITS) {
+                        for (; offset < BITS_PER_WORD; offset++) {
+                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                                if ((b->v[ix] & mask)==0) {
+                                        b->v[ix] |= mask;
+                                        *index = (ix*BITS_PER_WORD)+offset;
+                                        KASSERT(*index < b->nbits);
+                                        return 0;
+                                }
+                        }
+                }
+                offset = 0;
+                ix = (ix + 1) % maxix;
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
@@ -69,6 +69,7 @@ kprintf_bootstrap(void)
 		panic("Could not create kprintf_lock\n");
 	}
 	spinlock_init(&kprintf_spinlock);
+	spinlock_setname(&kprintf_spinlock, "kprintf");
 }
 
 /*
@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -50,6 +51,13 @@
 #include <vfs.h>
 #include <synch.h>
 #include <kern/fcntl.h>  
+#include <kern/unistd.h>
+#include <limits.h>
+#include <bitmap.h>
+#include <filetable.h>
+#if OPT_SCHEDTRACE
+#include <schedtrace.h>
+#endif
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -68,10 +76,6 @@ static struct semaphore *proc_count_mutex;
 /* used to signal the kernel menu thread when there are no processes */
 struct semaphore *no_proc_sem;   
 #endif  // UW
-#if OPT_A2
-pid_t A2_HIGHEST_PID = 2;
-pid_t A2_MAX_PID = 32768;
-#endif
 
 /*
  * Create a proc structure.
@@ -94,6 +98,7 @@ proc_create(const char *name)
 
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
+	spinlock_setname(&proc->p_lock, "proc");
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -104,6 +109,13 @@ proc_create(const char *name)
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
+#if OPT_A2
+	proc->p_filetable = NULL;
+#endif
+
+#if OPT_SCHEDTRACE
+	proc->p_schedtrace = NULL;
+#endif
 
 	return proc;
 }
@@ -164,6 +176,17 @@ proc_destroy(struct proc *proc)
 	  vfs_close(proc->console);
 	}
 #endif // UW
+#if OPT_A2
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+	}
+#endif
+
+#if OPT_SCHEDTRACE
+	if (proc->p_schedtrace != NULL) {
+		schedtrace_procfree(proc->p_schedtrace);
+	}
+#endif
 
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
@@ -199,6 +222,9 @@ proc_bootstrap(void)
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
   }
+#if OPT_SCHEDTRACE
+  kproc->p_schedtrace = schedtrace_procalloc(kproc->p_name, -1);
+#endif
 #ifdef UW
   proc_count = 0;
   proc_count_mutex = sem_create("proc_count_mutex",1);
@@ -212,6 +238,40 @@ proc_bootstrap(void)
 #endif // UW 
 }
 
+#if OPT_A2
+/*
+ * Make a file table with the console open as stdin, stdout and stderr.
+ * This should always succeed.
+ */
+static
+struct filetable *
+proc_console_filetable(void)
+{
+	struct filetable *ft;
+	struct openfile *of;
+	char path[5];
+	int fd, newfd;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+		/* vfs_open may change the path, so copy it each time */
+		strcpy(path, "con:");
+		if (openfile_open(path, fd == STDIN_FILENO ? O_RDONLY : O_WRONLY,
+				  0, &of)) {
+			panic("unable to open the console during process creation\n");
+		}
+		if (filetable_place(ft, of, &newfd)) {
+			panic("no fd for the console during process creation\n");
+		}
+		KASSERT(newfd == fd);
+	}
+	return ft;
+}
+#endif
+
 /*
  * Create a fresh proc for use by runprogram.
  *
@@ -222,50 +282,59 @@ struct proc *
 proc_create_runprogram(const char *name)
 {
 	struct proc *proc;
+#if !OPT_A2
 	char *console_path;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
 		return NULL;
 	}
 #if OPT_A2
-	//KASSERT(pid_pool != NULL);
-	if (pid_pool == NULL){
-		pid_pool = array_create();
-	}
-	if (proc_tables == NULL){
-		proc_tables = array_create();
-	}
-	if (pid_pool_lock == NULL){
-		pid_pool_lock = lock_create("pid_pool_lockk");
+	/*
+	 * Share the creating process's open files, as fork and spawn
+	 * should. A process started from the menu gets the console as
+	 * stdin, stdout and stderr.
+	 */
+	if (curproc->p_filetable != NULL) {
+		if (filetable_copy(curproc->p_filetable, &proc->p_filetable)) {
+			proc->p_filetable = NULL;
+		}
+	} else {
+		proc->p_filetable = proc_console_filetable();
 	}
 	if (proc_table_lock == NULL){
 		proc_table_lock = lock_create("proc_table_lockk");
 	}
-	lock_acquire(pid_pool_lock);
-	if (array_num(pid_pool) != 0) {
-		pid_t* curr_pid_pt = (pid_t*)array_get(pid_pool, 0);
-		pid_t curr_pid = *curr_pid_pt;
-		KASSERT(curr_pid_pt != NULL);
-		proc -> pid = curr_pid;
-		array_remove(pid_pool, 0);
-	} else {
-		if (A2_HIGHEST_PID == A2_MAX_PID) {
-			return NULL;
+	struct proc_table* pt = NULL;
+	if (proc->p_filetable != NULL) {
+		lock_acquire(proc_table_lock);
+		pt = add_proc_table();
+		lock_release(proc_table_lock);
+	}
+	if (pt == NULL) {
+		/* not counted in proc_count yet, so not proc_destroy */
+		if (proc->p_filetable != NULL) {
+			filetable_destroy(proc->p_filetable);
 		}
-		proc -> pid = A2_HIGHEST_PID++;
+		threadarray_cleanup(&proc->p_threads);
+		spinlock_cleanup(&proc->p_lock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
 	}
-	lock_release(pid_pool_lock);
-	struct proc_table* pt = kmalloc(sizeof(struct proc_table));
-	pt -> pid = proc -> pid;
-	pt -> ppid = -1;
-	pt -> state = PROC_RUNNING;
-	pt -> exitcode = 0;
-	lock_acquire(proc_table_lock);
-	array_add(proc_tables, pt, NULL);
-	lock_release(proc_table_lock);
+	proc -> pid = pt -> pid;
 #endif
-#ifdef UW
+#if OPT_SCHEDTRACE
+#if OPT_A2
+	proc->p_schedtrace = schedtrace_procalloc(name, proc->pid);
+#else
+	proc->p_schedtrace = schedtrace_procalloc(name, -1);
+#endif
+#endif
+#if OPT_A2
+	/* the console is in the file table instead */
+#elif defined(UW)
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
 	if (console_path == NULL) {
@@ -404,15 +473,238 @@ curproc_setas(struct addrspace *newas)
 }
 
 #if OPT_A2
+/*
+ * The process table is indexed by pid, as a two-level radix tree:
+ * the top bits of the pid pick a leaf, allocated the first time a pid
+ * in its range is used, and the low bits pick the slot. Lookups are
+ * O(1) however many processes have come and gone, and an entry is
+ * freed as soon as nobody can wait for its process any more.
+ *
+ * All of it is protected by proc_table_lock.
+ */
+#define PROC_TABLE_LEAFBITS 8
+#define PROC_TABLE_LEAFSIZE (1 << PROC_TABLE_LEAFBITS)
+#define PROC_TABLE_NLEAVES ((PID_MAX >> PROC_TABLE_LEAFBITS) + 1)
+
+static struct proc_table **proc_table_leaves[PROC_TABLE_NLEAVES];
+
+/*
+ * Pids in use are set in pid_bitmap (which is created on first use).
+ * Allocation searches from pid_next, just past the last pid handed
+ * out, so pids go round in rotation rather than being reused at once.
+ */
+static struct bitmap *pid_bitmap;
+static unsigned pid_next = PID_MIN;
+
+static int alloc_pid(pid_t *pid) {
+	unsigned index, i;
+	int result;
+
+	if (pid_bitmap == NULL) {
+		pid_bitmap = bitmap_create(PID_MAX + 1);
+		if (pid_bitmap == NULL) {
+			return ENOMEM;
+		}
+		for (i = 0; i < PID_MIN; ++i) {
+			bitmap_mark(pid_bitmap, i);
+		}
+	}
+	result = bitmap_alloc_from(pid_bitmap, pid_next, &index);
+	if (result) {
+		return ENPROC;
+	}
+	pid_next = index + 1 > PID_MAX ? PID_MIN : index + 1;
+	*pid = index;
+	return 0;
+}
+
+static struct proc_table **proc_table_slot(pid_t pid, bool create) {
+	struct proc_table **leaf;
+	unsigned i;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return NULL;
+	}
+	leaf = proc_table_leaves[pid >> PROC_TABLE_LEAFBITS];
+	if (leaf == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		leaf = kmalloc(PROC_TABLE_LEAFSIZE * sizeof(*leaf));
+		if (leaf == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < PROC_TABLE_LEAFSIZE; ++i) {
+			leaf[i] = NULL;
+		}
+		proc_table_leaves[pid >> PROC_TABLE_LEAFBITS] = leaf;
+	}
+	return &leaf[pid & (PROC_TABLE_LEAFSIZE - 1)];
+}
+
 struct proc_table* find_proc_table(pid_t pid) {
-	for (unsigned i = 0; i < array_num(proc_tables); ++i) {
-		struct proc_table* curr_pt = array_get(proc_tables, i);
-		if (curr_pt -> pid == pid) {
-			return curr_pt;
+	struct proc_table **slot;
+
+	KASSERT(lock_do_i_hold(proc_table_lock));
+	slot = proc_table_slot(pid, false);
+	return slot == NULL ? NULL : *slot;
+}
+
+/*
+ * Make a running entry, with no parent, for a new process, and give it
+ * a pid. Returns NULL if there are no pids left or out of memory.
+ */
+struct proc_table* add_proc_table(void) {
+	struct proc_table **slot;
+	struct proc_table *pt;
+	pid_t pid;
+
+	KASSERT(lock_do_i_hold(proc_table_lock));
+	if (alloc_pid(&pid)) {
+		return NULL;
+	}
+	slot = proc_table_slot(pid, true);
+	if (slot == NULL) {
+		bitmap_unmark(pid_bitmap, pid);
+		return NULL;
+	}
+	KASSERT(*slot == NULL);
+	pt = kmalloc(sizeof(struct proc_table));
+	if (pt == NULL) {
+		bitmap_unmark(pid_bitmap, pid);
+		return NULL;
+	}
+	pt -> wait_cv = cv_create("proc_wait");
+	if (pt -> wait_cv == NULL) {
+		kfree(pt);
+		bitmap_unmark(pid_bitmap, pid);
+		return NULL;
+	}
+	pt -> pid = pid;
+	pt -> ppid = -1;
+	pt -> state = PROC_RUNNING;
+	pt -> exitcode = 0;
+	pt -> parent = NULL;
+	pt -> children = NULL;
+	pt -> children_tail = NULL;
+	pt -> next_sibling = NULL;
+	pt -> prev_sibling = NULL;
+	*slot = pt;
+	return pt;
+}
+
+/*
+ * Make PT, which has no parent yet, a child of PPT. It goes at the end
+ * of the children, behind any zombies at the front.
+ */
+void set_proc_parent(struct proc_table* pt, struct proc_table* ppt) {
+	KASSERT(lock_do_i_hold(proc_table_lock));
+	KASSERT(pt -> parent == NULL);
+	pt -> parent = ppt;
+	pt -> ppid = ppt -> pid;
+	pt -> next_sibling = NULL;
+	pt -> prev_sibling = ppt -> children_tail;
+	if (ppt -> children_tail != NULL) {
+		ppt -> children_tail -> next_sibling = pt;
+	} else {
+		ppt -> children = pt;
+	}
+	ppt -> children_tail = pt;
+}
+
+/*
+ * Same, but at the front of the children.
+ */
+static void set_proc_parent_first(struct proc_table* pt,
+				  struct proc_table* ppt) {
+	KASSERT(pt -> parent == NULL);
+	pt -> parent = ppt;
+	pt -> ppid = ppt -> pid;
+	pt -> prev_sibling = NULL;
+	pt -> next_sibling = ppt -> children;
+	if (ppt -> children != NULL) {
+		ppt -> children -> prev_sibling = pt;
+	} else {
+		ppt -> children_tail = pt;
+	}
+	ppt -> children = pt;
+}
+
+static void unlink_proc_parent(struct proc_table* pt) {
+	struct proc_table* ppt = pt -> parent;
+
+	if (ppt == NULL) {
+		return;
+	}
+	if (pt -> prev_sibling != NULL) {
+		pt -> prev_sibling -> next_sibling = pt -> next_sibling;
+	} else {
+		KASSERT(ppt -> children == pt);
+		ppt -> children = pt -> next_sibling;
+	}
+	if (pt -> next_sibling != NULL) {
+		pt -> next_sibling -> prev_sibling = pt -> prev_sibling;
+	} else {
+		KASSERT(ppt -> children_tail == pt);
+		ppt -> children_tail = pt -> prev_sibling;
+	}
+	pt -> parent = NULL;
+	pt -> ppid = -1;
+	pt -> next_sibling = NULL;
+	pt -> prev_sibling = NULL;
+}
+
+/*
+ * PT's process has exited with its exit code set: make it a zombie,
+ * move it to the front of its parent's children (new children go at
+ * the back, so waiting for any child only has to look at the first)
+ * and wake the parent.
+ */
+void mark_proc_zombie(struct proc_table* pt) {
+	struct proc_table* ppt = pt -> parent;
+
+	KASSERT(lock_do_i_hold(proc_table_lock));
+	KASSERT(ppt != NULL);
+	pt -> state = PROC_ZOMBIE;
+	unlink_proc_parent(pt);
+	set_proc_parent_first(pt, ppt);
+	cv_broadcast(ppt -> wait_cv, proc_table_lock);
+}
+
+/*
+ * PPT is exiting: reap its children that have already exited, and
+ * orphan the rest so that they reap themselves. Costs one step per
+ * child.
+ */
+void orphan_proc_children(struct proc_table* ppt) {
+	struct proc_table *pt;
+
+	KASSERT(lock_do_i_hold(proc_table_lock));
+	while (ppt -> children != NULL) {
+		pt = ppt -> children;
+		if (pt -> state == PROC_ZOMBIE) {
+			reap_proc_table(pt);
+		} else {
+			unlink_proc_parent(pt);
 		}
 	}
-	// KASSERT(false);
-	return NULL;
 }
-#endif
 
+/*
+ * Done with PT: its process has exited and nobody can wait for it any
+ * more. Free the entry and give its pid back.
+ */
+void reap_proc_table(struct proc_table* pt) {
+	struct proc_table **slot;
+
+	KASSERT(lock_do_i_hold(proc_table_lock));
+	KASSERT(pt -> children == NULL);
+	unlink_proc_parent(pt);
+	slot = proc_table_slot(pt -> pid, false);
+	KASSERT(slot != NULL && *slot == pt);
+	*slot = NULL;
+	cv_destroy(pt -> wait_cv);
+	bitmap_unmark(pid_bitmap, pt -> pid);
+	kfree(pt);
+}
+#endif
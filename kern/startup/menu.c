@@ -45,6 +45,14 @@
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
+#include "opt-schedtrace.h"
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
+#if OPT_SCHEDTRACE
+#include <schedtrace.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -407,6 +415,76 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sched_printstats();
+
+	return 0;
+}
+
+#if OPT_SCHEDTRACE
+/*
+ * Command for scheduler latency histograms.
+ */
+static
+int
+cmd_schedtrace(int nargs, char **args)
+{
+	if (nargs == 1) {
+		sched_printtrace();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		schedtrace_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		schedtrace_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		sched_resettrace();
+	}
+	else {
+		kprintf("Usage: st [on|off|reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
+#if OPT_LOCKSTAT
+/*
+ * Command for lock contention statistics.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockstat_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockstat_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else {
+		kprintf("Usage: lockstat [on|off|reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -476,6 +554,10 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] RW lock test          (1)     ",
+	"[sy5] Priority inversion    (1)     ",
+	"[sl1] Spinlock benchmark            ",
+	"[ct1] Callout test                  ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -516,6 +598,13 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[ss] Scheduler stats                ",
+#if OPT_SCHEDTRACE
+	"[st] Scheduler latency histograms   ",
+#endif
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
     "[dth] Enable debugging              ",
 	"[q] Quit and shut down              ",
 	NULL
@@ -574,6 +663,13 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ss",         cmd_schedstats },
+#if OPT_SCHEDTRACE
+	{ "st",		cmd_schedtrace },
+#endif
+#if OPT_LOCKSTAT
+	{ "lockstat",	cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -591,6 +687,10 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	pitest },
+	{ "sl1",	spinlocktest },
+	{ "ct1",	callouttest },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
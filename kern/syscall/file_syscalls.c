@@ -8,7 +8,525 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#if OPT_A2
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <kern/iovec.h>
+#include <limits.h>
+#include <synch.h>
+#include <copyinout.h>
+#include <filetable.h>
+#endif
 
+#if OPT_A2
+/*
+ * File system calls, on top of the process's file table (see
+ * filetable.h). Reads, writes and seeks on a shared open file hold its
+ * offset lock throughout, so they are atomic with respect to each
+ * other; on an unshared one they don't need it. pread and pwrite
+ * don't use the offset and so never lock.
+ */
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  const int allflags = O_ACCMODE | O_CREAT | O_EXCL | O_TRUNC | O_APPEND
+    | O_NOCTTY;
+  struct openfile *of;
+  char *path;
+  int result;
+
+  if ((flags & ~allflags) != 0 || (flags & O_ACCMODE) == O_ACCMODE) {
+    return EINVAL;
+  }
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+  result = openfile_open(path, flags, mode, &of);
+  kfree(path);
+  if (result) {
+    return result;
+  }
+  result = filetable_place(curproc->p_filetable, of, retval);
+  if (result) {
+    openfile_decref(of);
+    return result;
+  }
+  return 0;
+}
+
+/*
+ * Whether anything besides the caller's one fd refers to OF. Only the
+ * calling process's own thread can add references to an open file
+ * that isn't shared (by fork, spawn or dup2), so if this says false it
+ * stays false until the caller does one of those.
+ */
+static
+bool
+file_shared(struct openfile *of)
+{
+  bool shared;
+
+  spinlock_acquire(&of->of_reflock);
+  shared = of->of_refcount > 1;
+  spinlock_release(&of->of_reflock);
+  return shared;
+}
+
+/*
+ * Common code for read, write, pread, pwrite, readv and writev: move
+ * LEN bytes between the file and the IOVCNT user buffers in IOV, in a
+ * single VOP_READ or VOP_WRITE. If POS is NULL, the
+ * transfer is at (and moves) the open file's offset; otherwise it is
+ * at *POS and the offset is neither used nor locked, so positional
+ * I/O on a shared file never waits for other users of it.
+ *
+ * The offset lock is only taken when the open file is shared: with
+ * one reference nobody else can be moving the offset.
+ */
+static
+int
+file_rw(int fd, struct iovec *iov, unsigned iovcnt, size_t len,
+        enum uio_rw rw, const off_t *pos, int *retval)
+{
+  struct openfile *of;
+  struct uio u;
+  struct stat st;
+  bool locked;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, fd, &of);
+  if (result) {
+    return result;
+  }
+  if (of->of_accmode == (rw == UIO_READ ? O_WRONLY : O_RDONLY)) {
+    return EBADF;
+  }
+
+  /* set up a uio structure to refer to the user program's buffers */
+  u.uio_iov = iov;
+  u.uio_iovcnt = iovcnt;
+  u.uio_resid = len;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  if (pos != NULL) {
+    if (*pos < 0) {
+      return EINVAL;
+    }
+    /* fails (ESPIPE) for the console and other unseekable objects */
+    result = VOP_TRYSEEK(of->of_vnode, *pos);
+    if (result) {
+      return result;
+    }
+    u.uio_offset = *pos;
+    result = rw == UIO_READ ? VOP_READ(of->of_vnode, &u)
+      : VOP_WRITE(of->of_vnode, &u);
+    if (result) {
+      return result;
+    }
+  } else {
+    locked = file_shared(of);
+    if (locked) {
+      lock_acquire(of->of_offsetlock);
+    }
+    if (rw == UIO_WRITE && of->of_append) {
+      result = VOP_STAT(of->of_vnode, &st);
+      if (result) {
+        goto out;
+      }
+      of->of_offset = st.st_size;
+    }
+    u.uio_offset = of->of_offset;
+    result = rw == UIO_READ ? VOP_READ(of->of_vnode, &u)
+      : VOP_WRITE(of->of_vnode, &u);
+    if (result == 0) {
+      of->of_offset = u.uio_offset;
+    }
+  out:
+    if (locked) {
+      lock_release(of->of_offsetlock);
+    }
+    if (result) {
+      return result;
+    }
+  }
+
+  /* pass back the number of bytes actually transferred */
+  *retval = len - u.uio_resid;
+  return 0;
+}
+
+/* Read or write one user buffer. */
+static
+int
+file_rw1(int fd, userptr_t buf, size_t len, enum uio_rw rw, const off_t *pos,
+         int *retval)
+{
+  struct iovec iov;
+
+  iov.iov_ubase = buf;
+  iov.iov_len = len;
+  return file_rw(fd, &iov, 1, len, rw, pos, retval);
+}
+
+int
+sys_read(int fdesc, userptr_t ubuf, size_t nbytes, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw1(fdesc, ubuf, nbytes, UIO_READ, NULL, retval);
+}
+
+int
+sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return file_rw1(fdesc, ubuf, nbytes, UIO_WRITE, NULL, retval);
+}
+
+int
+sys_pread(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+  return file_rw1(fdesc, ubuf, nbytes, UIO_READ, &pos, retval);
+}
+
+int
+sys_pwrite(int fdesc, userptr_t ubuf, size_t nbytes, off_t pos, int *retval)
+{
+  return file_rw1(fdesc, ubuf, nbytes, UIO_WRITE, &pos, retval);
+}
+
+/*
+ * readv and writev: copy in the user's iovec array and hand it, as it
+ * is, to one VOP_READ or VOP_WRITE.
+ */
+static
+int
+file_rwv(int fd, userptr_t uiov, int iovcnt, enum uio_rw rw, int *retval)
+{
+  struct iovec *iov;
+  size_t len;
+  int i, result;
+
+  if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+    return EINVAL;
+  }
+  iov = kmalloc(iovcnt * sizeof(*iov));
+  if (iov == NULL) {
+    return ENOMEM;
+  }
+  result = copyin(uiov, iov, iovcnt * sizeof(*iov));
+  if (result) {
+    kfree(iov);
+    return result;
+  }
+  /* the total is returned as an int, so must fit in one */
+  len = 0;
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > 0x7fffffff - len) {
+      kfree(iov);
+      return EINVAL;
+    }
+    len += iov[i].iov_len;
+  }
+  result = file_rw(fd, iov, iovcnt, len, rw, NULL, retval);
+  kfree(iov);
+  return result;
+}
+
+int
+sys_readv(int fdesc, userptr_t uiov, int iovcnt, int *retval)
+{
+  return file_rwv(fdesc, uiov, iovcnt, UIO_READ, retval);
+}
+
+int
+sys_writev(int fdesc, userptr_t uiov, int iovcnt, int *retval)
+{
+  return file_rwv(fdesc, uiov, iovcnt, UIO_WRITE, retval);
+}
+
+#define FILECOPY_MINCHUNK 512		/* for objects with no st_blksize */
+#define FILECOPY_MAXCHUNK 16384
+
+/* The I/O size the file system likes for OF, or 0 if it doesn't say. */
+static
+size_t
+file_blksize(struct openfile *of)
+{
+  struct stat st;
+
+  if (VOP_STAT(of->of_vnode, &st) != 0 || st.st_blksize == 0) {
+    return 0;
+  }
+  return st.st_blksize;
+}
+
+/*
+ * copy_file_range: copy up to LEN bytes from INFD at its offset to
+ * OUTFD at its offset, moving both, without the data going through
+ * user space. It goes through a kernel buffer the size of the larger
+ * of the two files' st_blksize (an SFS block, or the largest transfer
+ * emufs does in one go), so from aligned offsets each VOP_READ and
+ * VOP_WRITE is of whole blocks.
+ *
+ * Both offset locks are held throughout, if the files are shared, so
+ * the copy is atomic with respect to reads and writes on either; they
+ * are taken in address order so that two copies in opposite
+ * directions can't deadlock. Copying a file onto itself is EINVAL.
+ *
+ * Returns the number of bytes copied, which is 0 at end of file and
+ * short only at end of file or on an error after some were copied.
+ */
+int
+sys_copy_file_range(int infd, int outfd, size_t len, int *retval)
+{
+  struct openfile *inof, *outof, *first, *second;
+  struct iovec iov;
+  struct uio u;
+  struct stat st;
+  size_t chunk, outchunk, n, done, total;
+  bool lockfirst, locksecond;
+  char *buf;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, infd, &inof);
+  if (result) {
+    return result;
+  }
+  result = filetable_get(curproc->p_filetable, outfd, &outof);
+  if (result) {
+    return result;
+  }
+  if (inof->of_accmode == O_WRONLY || outof->of_accmode == O_RDONLY) {
+    return EBADF;
+  }
+  if (inof->of_vnode == outof->of_vnode) {
+    return EINVAL;
+  }
+  /* the count is returned as an int, so must fit in one */
+  if (len > 0x7fffffff) {
+    len = 0x7fffffff;
+  }
+
+  chunk = file_blksize(inof);
+  outchunk = file_blksize(outof);
+  if (outchunk > chunk) {
+    chunk = outchunk;
+  }
+  if (chunk < FILECOPY_MINCHUNK) {
+    chunk = FILECOPY_MINCHUNK;
+  }
+  else if (chunk > FILECOPY_MAXCHUNK) {
+    chunk = FILECOPY_MAXCHUNK;
+  }
+  buf = kmalloc(chunk);
+  if (buf == NULL) {
+    return ENOMEM;
+  }
+
+  if (inof < outof) {
+    first = inof;
+    second = outof;
+  } else {
+    first = outof;
+    second = inof;
+  }
+  lockfirst = file_shared(first);
+  locksecond = file_shared(second);
+  if (lockfirst) {
+    lock_acquire(first->of_offsetlock);
+  }
+  if (locksecond) {
+    lock_acquire(second->of_offsetlock);
+  }
+
+  if (outof->of_append) {
+    result = VOP_STAT(outof->of_vnode, &st);
+    if (result) {
+      goto out;
+    }
+    outof->of_offset = st.st_size;
+  }
+
+  total = 0;
+  while (total < len) {
+    n = len - total < chunk ? len - total : chunk;
+    uio_kinit(&iov, &u, buf, n, inof->of_offset, UIO_READ);
+    result = VOP_READ(inof->of_vnode, &u);
+    if (result) {
+      break;
+    }
+    n -= u.uio_resid;
+    if (n == 0) {
+      /* end of file */
+      break;
+    }
+
+    uio_kinit(&iov, &u, buf, n, outof->of_offset, UIO_WRITE);
+    result = VOP_WRITE(outof->of_vnode, &u);
+    done = n - u.uio_resid;
+    /* only count as read what actually got written */
+    inof->of_offset += done;
+    outof->of_offset += done;
+    total += done;
+    if (result || done < n) {
+      break;
+    }
+  }
+  /* report a partial copy, and leave the error for the next call */
+  if (total > 0) {
+    result = 0;
+  }
+
+  out:
+  if (locksecond) {
+    lock_release(second->of_offsetlock);
+  }
+  if (lockfirst) {
+    lock_release(first->of_offsetlock);
+  }
+  kfree(buf);
+  if (result) {
+    return result;
+  }
+  *retval = total;
+  return 0;
+}
+
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  bool locked;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (result) {
+    return result;
+  }
+
+  locked = file_shared(of);
+  if (locked) {
+    lock_acquire(of->of_offsetlock);
+  }
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    result = VOP_STAT(of->of_vnode, &st);
+    if (result) {
+      goto out;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    result = EINVAL;
+    goto out;
+  }
+  if (newpos < 0) {
+    result = EINVAL;
+    goto out;
+  }
+  /* fails (ESPIPE) for the console and other unseekable objects */
+  result = VOP_TRYSEEK(of->of_vnode, newpos);
+  if (result) {
+    goto out;
+  }
+  of->of_offset = newpos;
+
+  out:
+  if (locked) {
+    lock_release(of->of_offsetlock);
+  }
+  if (result) {
+    return result;
+  }
+
+  *retval = newpos;
+  return 0;
+}
+
+int
+sys_close(int fdesc)
+{
+  struct openfile *of;
+  int result;
+
+  result = filetable_remove(curproc->p_filetable, fdesc, &of);
+  if (result) {
+    return result;
+  }
+  openfile_decref(of);
+  return 0;
+}
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct openfile *of, *oldof;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, oldfd, &of);
+  if (result) {
+    return result;
+  }
+  if (newfd != oldfd) {
+    openfile_incref(of);
+    result = filetable_placeat(curproc->p_filetable, of, newfd, &oldof);
+    if (result) {
+      openfile_decref(of);
+      return result;
+    }
+    if (oldof != NULL) {
+      openfile_decref(oldof);
+    }
+  }
+  *retval = newfd;
+  return 0;
+}
+
+/*
+ * Only the per-fd flags (F_GETFD, F_SETFD) and F_GETFL are supported.
+ */
+int
+sys_fcntl(int fdesc, int cmd, int arg, int *retval)
+{
+  struct openfile *of;
+  int result;
+
+  switch (cmd) {
+  case F_GETFD:
+    return filetable_getflags(curproc->p_filetable, fdesc, retval);
+  case F_SETFD:
+    return filetable_setflags(curproc->p_filetable, fdesc, arg);
+  case F_GETFL:
+    result = filetable_get(curproc->p_filetable, fdesc, &of);
+    if (result) {
+      return result;
+    }
+    *retval = of->of_accmode | (of->of_append ? O_APPEND : 0);
+    return 0;
+  default:
+    return EINVAL;
+  }
+}
+
+#else /* OPT_A2 */
 /* handler for write() system call                  */
 /*
  * n.b.
@@ -58,3 +576,4 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+#endif /* OPT_A2 */
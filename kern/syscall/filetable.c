@@ -0,0 +1,227 @@
+/*
+ * Open files and per-process file tables. See filetable.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <filetable.h>
+
+////////////////////////////////////////////////////////////
+// openfile
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct openfile *of;
+	struct vnode *vn;
+	int result;
+
+	of = kmalloc(sizeof(*of));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_offsetlock = lock_create("openfile");
+	if (of->of_offsetlock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	result = vfs_open(path, flags, mode, &vn);
+	if (result) {
+		lock_destroy(of->of_offsetlock);
+		kfree(of);
+		return result;
+	}
+
+	of->of_vnode = vn;
+	of->of_accmode = flags & O_ACCMODE;
+	of->of_append = (flags & O_APPEND) != 0;
+	of->of_offset = 0;
+	spinlock_init(&of->of_reflock);
+	of->of_refcount = 1;
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_reflock);
+	of->of_refcount++;
+	spinlock_release(&of->of_reflock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool last;
+
+	spinlock_acquire(&of->of_reflock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	last = of->of_refcount == 0;
+	spinlock_release(&of->of_reflock);
+
+	if (last) {
+		vfs_close(of->of_vnode);
+		lock_destroy(of->of_offsetlock);
+		spinlock_cleanup(&of->of_reflock);
+		kfree(of);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// filetable
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = kmalloc(sizeof(*ft));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (i=0; i<OPEN_MAX; i++) {
+		ft->ft_files[i] = NULL;
+		ft->ft_flags[i] = 0;
+	}
+	return ft;
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	unsigned i;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<OPEN_MAX; i++) {
+		if (src->ft_files[i] != NULL) {
+			openfile_incref(src->ft_files[i]);
+			ft->ft_files[i] = src->ft_files[i];
+			ft->ft_flags[i] = src->ft_flags[i];
+		}
+	}
+	*ret = ft;
+	return 0;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	unsigned i;
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL) {
+			openfile_decref(ft->ft_files[i]);
+		}
+	}
+	kfree(ft);
+}
+
+static
+bool
+filetable_okfd(int fd)
+{
+	return fd >= 0 && fd < OPEN_MAX;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (!filetable_okfd(fd) || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *of, int *fd)
+{
+	int i;
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			ft->ft_flags[i] = 0;
+			*fd = i;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
+
+int
+filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		  struct openfile **oldof)
+{
+	if (!filetable_okfd(fd)) {
+		return EBADF;
+	}
+	*oldof = ft->ft_files[fd];
+	ft->ft_files[fd] = of;
+	ft->ft_flags[fd] = 0;
+	return 0;
+}
+
+int
+filetable_remove(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (!filetable_okfd(fd) || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	ft->ft_files[fd] = NULL;
+	ft->ft_flags[fd] = 0;
+	return 0;
+}
+
+int
+filetable_getflags(struct filetable *ft, int fd, int *flags)
+{
+	if (!filetable_okfd(fd) || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*flags = ft->ft_flags[fd];
+	return 0;
+}
+
+int
+filetable_setflags(struct filetable *ft, int fd, int flags)
+{
+	if (!filetable_okfd(fd) || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	if ((flags & ~FD_CLOEXEC) != 0) {
+		return EINVAL;
+	}
+	ft->ft_flags[fd] = flags;
+	return 0;
+}
+
+void
+filetable_closeexec(struct filetable *ft)
+{
+	unsigned i;
+
+	for (i=0; i<OPEN_MAX; i++) {
+		if (ft->ft_files[i] != NULL &&
+		    (ft->ft_flags[i] & FD_CLOEXEC) != 0) {
+			openfile_decref(ft->ft_files[i]);
+			ft->ft_files[i] = NULL;
+			ft->ft_flags[i] = 0;
+		}
+	}
+}
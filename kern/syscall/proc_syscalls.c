@@ -15,55 +15,62 @@
 #include <kern/fcntl.h>
 #include <vfs.h>
 #include <limits.h>
+#include <workqueue.h>
+#include <filetable.h>
+
+/*
+ * Freeing an exiting process's memory can take a while and nothing
+ * waits for it, so _exit hands it to the workqueue rather than making
+ * the parent's waitpid wait for it.
+ */
+struct as_reap {
+  struct work ar_work;
+  struct addrspace *ar_as;
+};
+
+static void as_reap_work(void *data1, unsigned long junk) {
+  struct as_reap *ar = data1;
+  (void)junk;
+  as_destroy(ar->ar_as);
+  kfree(ar);
+}
+
+static void as_destroy_later(struct addrspace *as) {
+  struct as_reap *ar = kmalloc(sizeof(*ar));
+  if (ar == NULL) {
+    as_destroy(as);
+    return;
+  }
+  ar->ar_as = as;
+  work_init(&ar->ar_work, as_reap_work, ar, 0);
+  work_queue(&ar->ar_work);
+}
 
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
 
 void sys__exit(int exitcode, bool exit_by_call) {
 #if OPT_A2
-  if (proc_table_cv == NULL){
-    proc_table_cv = cv_create("proc_table_cvv");
-  }
   pid_t currpid = curproc -> pid;
   lock_acquire(proc_table_lock);
   struct proc_table* pt = find_proc_table(currpid);
   KASSERT(pt != NULL);
-  if (pt -> ppid != -1){ // curproc is a child.
-    struct proc_table* ppt = find_proc_table(pt -> ppid);
-    // if (ppt == NULL){ // MYDEBUG
-    //   DEBUG(DB_SYSCALL, "PROC_SYSCALLS_C, ppt is null");
-    // }
+  // children that have exited are reaped; running ones are orphaned and
+  // will reap themselves when they exit.
+  orphan_proc_children(pt);
+  if (pt -> parent != NULL){ // curproc is a child.
+    // a parent orphans its children when it exits, so it's still running.
+    KASSERT(pt -> parent -> state == PROC_RUNNING);
     if (exit_by_call){
       pt -> exitcode = _MKWAIT_EXIT(exitcode);
     } else {
       pt -> exitcode = _MKWAIT_SIG(exitcode);
     }
-    if (ppt -> state == PROC_RUNNING){
-      pt -> state = PROC_ZOMBIE;
-      cv_broadcast(proc_table_cv, proc_table_lock);
-    } else {
-      // if parent exit, i exit. if parent zombie, i also exit
-      // since a parent can only become zombie when it run _exit() / exiting.
-      // so that parent won't have chance to be interested in me.
-      pt -> state = PROC_EXITED;
-      lock_acquire(pid_pool_lock);
-      array_add(pid_pool, &currpid, NULL);
-      lock_release(pid_pool_lock);
-    }
+    // wakes only our parent.
+    mark_proc_zombie(pt);
   } else {
-    pt -> state = PROC_EXITED;
-    lock_acquire(pid_pool_lock);
-    array_add(pid_pool, &currpid, NULL);
-    lock_release(pid_pool_lock);
-  }
-  for (unsigned i = 0; i < array_num(proc_tables); ++i){
-    struct proc_table* pt = array_get(proc_tables, i);
-    if ((pt -> ppid == currpid) && (pt -> state == PROC_ZOMBIE)){
-      pt -> state = PROC_EXITED;
-      lock_acquire(pid_pool_lock);
-      array_add(pid_pool, &(pt -> pid), NULL);
-      lock_release(pid_pool_lock);
-    }
+    // nobody can wait for us.
+    reap_proc_table(pt);
   }
   lock_release(proc_table_lock);
 #endif
@@ -75,7 +82,7 @@ void sys__exit(int exitcode, bool exit_by_call) {
 
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
-  KASSERT(curproc->p_addrspace != NULL);
+  /* a spawned child that failed to load its program may have none */
   as_deactivate();
   /*
    * clear p_addrspace before calling as_destroy. Otherwise if
@@ -85,7 +92,9 @@ void sys__exit(int exitcode, bool exit_by_call) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  if (as != NULL) {
+    as_destroy_later(as);
+  }
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
@@ -136,33 +145,55 @@ sys_waitpid(pid_t pid,
      Fix this!
   */
 
-  if (options != 0) {
-    return(EINVAL);
-  }
-  /* for now, just pretend the exitstatus is 0 */
 #if OPT_A2
-  if (proc_table_cv == NULL){
-    proc_table_cv = cv_create("proc_table_cvv");
+  if ((options & ~WNOHANG) != 0) {
+    return(EINVAL);
   }
   lock_acquire(proc_table_lock);
   struct proc_table* pt = find_proc_table(curproc -> pid);
   KASSERT(pt != NULL);
-  struct proc_table* wait_pt = find_proc_table(pid);
-  if (wait_pt == NULL) {
-    lock_release(proc_table_lock);
-    return (ESRCH);
+  struct proc_table* wait_pt;
+  if (pid == WAIT_ANY) {
+    // zombies are kept at the front of the children list, so the first
+    // child is the one to look at.
+    while (pt -> children != NULL && pt -> children -> state == PROC_RUNNING &&
+           (options & WNOHANG) == 0) {
+      cv_wait(pt -> wait_cv, proc_table_lock);
+    }
+    if (pt -> children == NULL) {
+      lock_release(proc_table_lock);
+      return (ECHILD);
+    }
+    wait_pt = pt -> children;
+  } else {
+    wait_pt = find_proc_table(pid);
+    if (wait_pt == NULL) {
+      lock_release(proc_table_lock);
+      return (ESRCH);
+    }
+    if (wait_pt -> parent != pt){
+      lock_release(proc_table_lock);
+      return (ECHILD);
+    }
+    while (wait_pt -> state == PROC_RUNNING && (options & WNOHANG) == 0){
+      cv_wait(pt -> wait_cv, proc_table_lock);
+    }
   }
-  if (wait_pt -> ppid != curproc -> pid){
+  if (wait_pt -> state == PROC_RUNNING) {
+    // WNOHANG, and nothing has exited yet.
     lock_release(proc_table_lock);
-    return (ECHILD);
-  }
-  // DEBUG(DB_SYSCALL, "wait_pt -> state == %d", wait_pt -> state);
-  while (wait_pt -> state == PROC_RUNNING){
-    cv_wait(proc_table_cv, proc_table_lock);
+    *retval = 0;
+    return(0);
   }
+  pid = wait_pt -> pid;
   exitstatus = wait_pt -> exitcode;
+  reap_proc_table(wait_pt);
   lock_release(proc_table_lock);
 #else
+  if (options != 0) {
+    return(EINVAL);
+  }
+  /* for now, just pretend the exitstatus is 0 */
   exitstatus = 0;
 #endif
   result = copyout((void *)&exitstatus,status,sizeof(int));
@@ -175,33 +206,42 @@ sys_waitpid(pid_t pid,
 #if OPT_A2
 int sys_fork(pid_t* retval, struct trapframe *tf){
     struct proc *child_proc = proc_create_runprogram(curproc -> p_name);
-    struct proc_table* pt = find_proc_table(child_proc -> pid);
-    pt -> ppid = curproc -> pid;
     if (child_proc == NULL) {
-        proc_destroy(child_proc);
         return ENPROC;
     }
+    lock_acquire(proc_table_lock);
+    struct proc_table* child_pt = find_proc_table(child_proc -> pid);
+    set_proc_parent(child_pt, find_proc_table(curproc -> pid));
+    lock_release(proc_table_lock);
+    int result;
     if (as_copy(curproc_getas(), &(child_proc -> p_addrspace)) != 0) {
-        proc_destroy(child_proc);
-        return ENOMEM;
+        result = ENOMEM;
+        goto fail;
     }
     struct trapframe* child_tf = kmalloc(sizeof(struct trapframe));
     if (!child_tf) {
-        proc_destroy(child_proc);
         // https://www.linuxjournal.com/article/6930
-        return ENOMEM;
+        result = ENOMEM;
+        goto fail;
     }
     // https://stackoverflow.com/questions/13284033/copying-structure-in-c-with-assignment-instead-of-memcpy#comment18110975_13284033
     memcpy(child_tf, tf, sizeof *child_tf);
-    int thread_fork_return = thread_fork(curthread -> t_name, child_proc, &enter_forked_process_wrapper, (void*)child_tf, 2333);
-    if (thread_fork_return) {
+    result = thread_fork(curthread -> t_name, child_proc, &enter_forked_process_wrapper, (void*)child_tf, 2333);
+    if (result) {
         kfree(child_tf);
-        proc_destroy(child_proc);
-        return thread_fork_return;
+        goto fail;
     }
-    (void)thread_fork_return;
     *retval = child_proc -> pid;
     return 0;
+
+fail:
+    // the child never ran: take it back out of the table before
+    // anyone can wait for it.
+    lock_acquire(proc_table_lock);
+    reap_proc_table(child_pt);
+    lock_release(proc_table_lock);
+    proc_destroy(child_proc);
+    return result;
 }
 
 int sys_execv(userptr_t program, userptr_t args) {
@@ -290,8 +330,224 @@ int sys_execv(userptr_t program, userptr_t args) {
     }
   }
   as_destroy(as);
+  filetable_closeexec(curproc -> p_filetable);
   enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
   return EINVAL;
   // What about ENODEV, ENOTDIR, EISDIR, ENOEXEC and EIO?
 }
+
+/*
+ * spawn: start a child running PROGRAM with arguments ARGS, without
+ * fork copying the parent's address space only for execv to throw it
+ * away. The cost doesn't depend on the size of the parent.
+ *
+ * The parent copies the path and arguments in, then sleeps while the
+ * child loads the program into a fresh address space (load_elf only
+ * works on the current one) and sets up its stack. The child reports
+ * back before going to user mode, so that errors such as a missing
+ * program go to the parent; a child that fails exits, and the parent
+ * reaps it before returning.
+ */
+struct spawn_args {
+  char *sa_path;
+  char **sa_argv;
+  char *sa_argbuf; // the argument strings
+  int sa_argc;
+  struct semaphore *sa_done;
+  int sa_result;
+};
+
+static void spawn_free_args(struct spawn_args *sa) {
+  kfree(sa->sa_path);
+  kfree(sa->sa_argv);
+  kfree(sa->sa_argbuf);
+}
+
+static int spawn_copyin_args(userptr_t program, userptr_t args,
+                             struct spawn_args *sa) {
+  userptr_t arg;
+  size_t used, len;
+  int argc, result;
+
+  sa->sa_path = kmalloc(PATH_MAX);
+  sa->sa_argbuf = kmalloc(ARG_MAX);
+  sa->sa_argv = NULL;
+  if (sa->sa_path == NULL || sa->sa_argbuf == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(program, sa->sa_path, PATH_MAX, NULL);
+  if (result) {
+    return result;
+  }
+  if (sa->sa_path[0] == 0) {
+    return ENOENT;
+  }
+
+  // count the arguments, then copy them in one after another.
+  for (argc = 0; ; ++argc) {
+    if (argc >= ARG_MAX / (int)sizeof(userptr_t)) {
+      return E2BIG;
+    }
+    result = copyin((userptr_t)((vaddr_t)args + argc * sizeof(userptr_t)),
+                    &arg, sizeof(arg));
+    if (result) {
+      return result;
+    }
+    if (arg == NULL) {
+      break;
+    }
+  }
+  sa->sa_argv = kmalloc((argc + 1) * sizeof(char *));
+  if (sa->sa_argv == NULL) {
+    return ENOMEM;
+  }
+  used = 0;
+  for (int i = 0; i < argc; ++i) {
+    result = copyin((userptr_t)((vaddr_t)args + i * sizeof(userptr_t)),
+                    &arg, sizeof(arg));
+    if (result) {
+      return result;
+    }
+    result = copyinstr(arg, sa->sa_argbuf + used, ARG_MAX - used, &len);
+    if (result) {
+      return result == ENAMETOOLONG ? E2BIG : result;
+    }
+    sa->sa_argv[i] = sa->sa_argbuf + used;
+    used += len;
+  }
+  sa->sa_argv[argc] = NULL;
+  sa->sa_argc = argc;
+  return 0;
+}
+
+/*
+ * The child's first function: load the program, copy the arguments
+ * onto its stack (strings at the top, argv below them), report to the
+ * parent, and go to user mode. SA belongs to the parent and mustn't be
+ * touched once sa_done has been signalled.
+ */
+static void spawn_enter(void *data1, unsigned long junk) {
+  struct spawn_args *sa = data1;
+  struct addrspace *as;
+  struct vnode *v;
+  vaddr_t entrypoint, stackptr, argvptr, strptr;
+  size_t len;
+  int argc, result;
+
+  (void)junk;
+
+  result = vfs_open(sa->sa_path, O_RDONLY, 0, &v);
+  if (result) {
+    goto fail;
+  }
+  as = as_create();
+  if (as == NULL) {
+    vfs_close(v);
+    result = ENOMEM;
+    goto fail;
+  }
+  curproc_setas(as);
+  as_activate();
+  result = load_elf(v, &entrypoint);
+  vfs_close(v);
+  if (result) {
+    goto fail;
+  }
+  result = as_define_stack(as, &stackptr);
+  if (result) {
+    goto fail;
+  }
+
+  argc = sa->sa_argc;
+  strptr = stackptr;
+  for (int i = 0; i < argc; ++i) {
+    strptr -= ROUNDUP(strlen(sa->sa_argv[i]) + 1, 4);
+  }
+  argvptr = (strptr - (argc + 1) * sizeof(vaddr_t)) & ~(vaddr_t)7;
+  for (int i = 0; i <= argc; ++i) {
+    vaddr_t uarg = 0;
+    if (i < argc) {
+      len = strlen(sa->sa_argv[i]) + 1;
+      result = copyoutstr(sa->sa_argv[i], (userptr_t)strptr, len, NULL);
+      if (result) {
+        goto fail;
+      }
+      uarg = strptr;
+      strptr += ROUNDUP(len, 4);
+    }
+    result = copyout(&uarg, (userptr_t)(argvptr + i * sizeof(vaddr_t)),
+                     sizeof(uarg));
+    if (result) {
+      goto fail;
+    }
+  }
+
+  filetable_closeexec(curproc -> p_filetable);
+  sa->sa_result = 0;
+  V(sa->sa_done);
+  enter_new_process(argc, (userptr_t)argvptr, argvptr, entrypoint);
+  panic("enter_new_process returned\n");
+
+ fail:
+  sa->sa_result = result;
+  V(sa->sa_done);
+  sys__exit(0, true);
+}
+
+int sys_spawn(userptr_t program, userptr_t args, pid_t *retval) {
+  struct spawn_args sa;
+  struct proc *child_proc;
+  struct proc_table *pt, *child_pt;
+  int result;
+
+  result = spawn_copyin_args(program, args, &sa);
+  if (result) {
+    spawn_free_args(&sa);
+    return result;
+  }
+  sa.sa_done = sem_create("spawn", 0);
+  if (sa.sa_done == NULL) {
+    spawn_free_args(&sa);
+    return ENOMEM;
+  }
+  child_proc = proc_create_runprogram(sa.sa_path);
+  if (child_proc == NULL) {
+    sem_destroy(sa.sa_done);
+    spawn_free_args(&sa);
+    return ENPROC;
+  }
+  lock_acquire(proc_table_lock);
+  pt = find_proc_table(curproc -> pid);
+  child_pt = find_proc_table(child_proc -> pid);
+  set_proc_parent(child_pt, pt);
+  lock_release(proc_table_lock);
+
+  result = thread_fork(sa.sa_path, child_proc, spawn_enter, &sa, 0);
+  if (result) {
+    lock_acquire(proc_table_lock);
+    reap_proc_table(child_pt);
+    lock_release(proc_table_lock);
+    proc_destroy(child_proc);
+    sem_destroy(sa.sa_done);
+    spawn_free_args(&sa);
+    return result;
+  }
+
+  P(sa.sa_done);
+  result = sa.sa_result;
+  if (result) {
+    // the child is exiting; collect it so nobody sees it.
+    lock_acquire(proc_table_lock);
+    while (child_pt -> state == PROC_RUNNING) {
+      cv_wait(pt -> wait_cv, proc_table_lock);
+    }
+    reap_proc_table(child_pt);
+    lock_release(proc_table_lock);
+  } else {
+    *retval = child_pt -> pid;
+  }
+  sem_destroy(sa.sa_done);
+  spawn_free_args(&sa);
+  return result;
+}
 #endif
@@ -0,0 +1,65 @@
+/*
+ * Scheduling system calls: cpu affinity.
+ *
+ * Masks have one bit per cpu (1 << cpu number). Affinity belongs to
+ * threads, and user processes have only one, so these act on the
+ * calling thread. There's no way to find another process's thread
+ * from its pid here, so PID must be 0 or the caller's own.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <current.h>
+#include <proc.h>
+#include <thread.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+static
+int
+sched_checkpid(pid_t pid)
+{
+	if (pid == 0) {
+		return 0;
+	}
+#if OPT_A2
+	if (pid == curproc->pid) {
+		return 0;
+	}
+#endif
+	return ESRCH;
+}
+
+int
+sys_sched_setaffinity(pid_t pid, userptr_t user_mask)
+{
+	uint32_t mask;
+	int result;
+
+	result = sched_checkpid(pid);
+	if (result) {
+		return result;
+	}
+
+	result = copyin(user_mask, &mask, sizeof(mask));
+	if (result) {
+		return result;
+	}
+
+	return thread_setaffinity(mask);
+}
+
+int
+sys_sched_getaffinity(pid_t pid, userptr_t user_mask)
+{
+	uint32_t mask;
+	int result;
+
+	result = sched_checkpid(pid);
+	if (result) {
+		return result;
+	}
+
+	mask = thread_getaffinity();
+	return copyout(&mask, user_mask, sizeof(mask));
+}
@@ -0,0 +1,171 @@
+/*
+ * Callout test.
+ *
+ * Arms a batch of callouts from a callout handler that runs on a tick
+ * that's a multiple of the wheel size, so that several of them expire
+ * exactly when a higher level of the timing wheel cascades down into
+ * level 0. Each should fire once, on the tick it was armed for.
+ *
+ * Then arms two callouts for the same tick, each of whose handlers
+ * stops the other: whichever runs first must keep the other from
+ * running, although both had already expired.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <test.h>
+
+#define CT_WHEEL	64	/* Level 0 of the wheel in clock.c */
+#define CT_NCASES	6
+#define CT_MAXNAPS	8	/* Give up after this many wheel turns */
+
+struct ct_case {
+	struct callout cc_co;
+	unsigned cc_delay;
+	unsigned cc_expect;		/* Tick it should fire on */
+	volatile unsigned cc_fired;	/* Tick it did fire on */
+	volatile unsigned cc_count;	/* Times it fired */
+};
+
+static const unsigned ct_delays[CT_NCASES] = {
+	1, CT_WHEEL - 1, CT_WHEEL, CT_WHEEL + 1, 2 * CT_WHEEL, 3 * CT_WHEEL,
+};
+
+static struct callout ct_arm;
+static struct ct_case ct_cases[CT_NCASES];
+static volatile bool ct_armed;
+static struct callout ct_pair[2];
+static volatile unsigned ct_paircount;
+
+static
+void
+ct_fire(void *data)
+{
+	struct ct_case *cc = data;
+
+	cc->cc_fired = callout_ticks();
+	cc->cc_count++;
+}
+
+static
+void
+ct_pair_fire(void *data)
+{
+	struct callout *other = data;
+
+	callout_stop(other);
+	ct_paircount++;
+}
+
+/*
+ * Wait for a tick on a wheel boundary, then arm the cases from there.
+ */
+static
+void
+ct_arm_fire(void *junk)
+{
+	unsigned now, i;
+
+	(void)junk;
+
+	now = callout_ticks();
+	if (now % CT_WHEEL != 0) {
+		callout_schedule(&ct_arm, CT_WHEEL - now % CT_WHEEL);
+		return;
+	}
+	for (i=0; i<CT_NCASES; i++) {
+		ct_cases[i].cc_expect = now + ct_cases[i].cc_delay;
+		callout_schedule(&ct_cases[i].cc_co, ct_cases[i].cc_delay);
+	}
+	ct_armed = true;
+}
+
+static
+bool
+ct_alldone(void)
+{
+	unsigned i;
+
+	if (!ct_armed) {
+		return false;
+	}
+	for (i=0; i<CT_NCASES; i++) {
+		if (ct_cases[i].cc_count == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+callouttest(int nargs, char **args)
+{
+	struct ct_case *cc;
+	unsigned i, naps;
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting callout test...\n");
+
+	ct_armed = false;
+	for (i=0; i<CT_NCASES; i++) {
+		cc = &ct_cases[i];
+		callout_init(&cc->cc_co, ct_fire, cc);
+		cc->cc_delay = ct_delays[i];
+		cc->cc_expect = 0;
+		cc->cc_fired = 0;
+		cc->cc_count = 0;
+	}
+	callout_init(&ct_arm, ct_arm_fire, NULL);
+	callout_schedule(&ct_arm, 1);
+
+	for (naps = 0; naps < CT_MAXNAPS && !ct_alldone(); naps++) {
+		clocknap(CT_WHEEL);
+	}
+
+	ok = ct_armed;
+	if (!ct_armed) {
+		kprintf("callouttest: never got to a wheel boundary\n");
+	}
+	for (i=0; ct_armed && i<CT_NCASES; i++) {
+		cc = &ct_cases[i];
+		if (cc->cc_count == 0) {
+			kprintf("callouttest: %u-tick callout never fired\n",
+				cc->cc_delay);
+			ok = false;
+		}
+		else if (cc->cc_count != 1 || cc->cc_fired != cc->cc_expect) {
+			kprintf("callouttest: %u-tick callout fired %u times, "
+				"last on tick %u, expected once on %u\n",
+				cc->cc_delay, cc->cc_count, cc->cc_fired,
+				cc->cc_expect);
+			ok = false;
+		}
+	}
+
+	ct_paircount = 0;
+	callout_init(&ct_pair[0], ct_pair_fire, &ct_pair[1]);
+	callout_init(&ct_pair[1], ct_pair_fire, &ct_pair[0]);
+	callout_schedule(&ct_pair[0], 2);
+	callout_schedule(&ct_pair[1], 2);
+	clocknap(CT_WHEEL);
+	if (ct_paircount != 1) {
+		kprintf("callouttest: %u of two callouts that stop each "
+			"other ran, expected 1\n", ct_paircount);
+		ok = false;
+	}
+
+	/* Nothing may still be pending when the callouts go away. */
+	callout_stop(&ct_arm);
+	for (i=0; i<CT_NCASES; i++) {
+		callout_stop(&ct_cases[i].cc_co);
+	}
+	callout_stop(&ct_pair[0]);
+	callout_stop(&ct_pair[1]);
+
+	kprintf("Callout test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
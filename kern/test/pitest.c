@@ -0,0 +1,162 @@
+/*
+ * Priority inversion test.
+ *
+ * A low-priority thread takes a lock and does a chunk of work holding
+ * it. A high-priority thread then wants the lock, while a crowd of
+ * medium-priority threads keep every cpu busy. Without priority
+ * inheritance the low-priority holder would sit on the bottom run
+ * queue behind the medium ones until aging rescued it; with it, the
+ * holder runs at the waiter's level, and the high-priority thread
+ * should wait not much longer than the critical section takes.
+ *
+ * The medium threads keep putting themselves back at their level, so
+ * that the scheduler's demotion doesn't end the inversion on its own.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define PI_NMEDIUM	16
+#define PI_HOLDLOOPS	200000
+#define PI_LOW		(SCHED_NLEVELS - 1)
+#define PI_MEDIUM	1
+#define PI_HIGH		0
+
+static struct lock *pilock;
+static struct semaphore *piheld;
+static struct semaphore *pidonesem;
+static volatile bool pidone;
+static volatile uint32_t piholdms;
+
+/* Milliseconds from (S1, NS1) to now. */
+static
+uint32_t
+pi_elapsed(time_t s1, uint32_t ns1)
+{
+	time_t s2, secs;
+	uint32_t ns2, nsecs;
+
+	gettime(&s2, &ns2);
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	return secs * 1000 + nsecs / 1000000;
+}
+
+static
+void
+pi_low(void *junk, unsigned long num)
+{
+	volatile int i;
+	time_t secs;
+	uint32_t nsecs;
+
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PI_LOW);
+	lock_acquire(pilock);
+	V(piheld);
+	gettime(&secs, &nsecs);
+	for (i=0; i<PI_HOLDLOOPS; i++);
+	piholdms = pi_elapsed(secs, nsecs);
+	lock_release(pilock);
+
+	V(pidonesem);
+	thread_exit();
+}
+
+static
+void
+pi_medium(void *junk, unsigned long num)
+{
+	volatile int i;
+
+	(void)junk;
+	(void)num;
+
+	while (!pidone) {
+		thread_setpriority(PI_MEDIUM);
+		for (i=0; i<1000; i++);
+	}
+
+	V(pidonesem);
+	thread_exit();
+}
+
+static
+void
+pi_high(void *junk, unsigned long num)
+{
+	time_t secs;
+	uint32_t nsecs, waitms;
+
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PI_HIGH);
+	gettime(&secs, &nsecs);
+	lock_acquire(pilock);
+	waitms = pi_elapsed(secs, nsecs);
+	lock_release(pilock);
+
+	pidone = true;
+	kprintf("pitest: high-priority thread waited %u ms "
+		"for a %u ms critical section\n", waitms, piholdms);
+
+	V(pidonesem);
+	thread_exit();
+}
+
+int
+pitest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	pilock = lock_create("pilock");
+	piheld = sem_create("piheld", 0);
+	pidonesem = sem_create("pidone", 0);
+	if (pilock == NULL || piheld == NULL || pidonesem == NULL) {
+		panic("pitest: out of memory\n");
+	}
+	pidone = false;
+	piholdms = 0;
+
+	kprintf("Starting priority inversion test...\n");
+
+	result = thread_fork("pi_low", NULL, pi_low, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(piheld);
+
+	for (i=0; i<PI_NMEDIUM; i++) {
+		result = thread_fork("pi_medium", NULL, pi_medium, NULL, i);
+		if (result) {
+			panic("pitest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	result = thread_fork("pi_high", NULL, pi_high, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	for (i=0; i<PI_NMEDIUM + 2; i++) {
+		P(pidonesem);
+	}
+
+	sem_destroy(pidonesem);
+	sem_destroy(piheld);
+	lock_destroy(pilock);
+	kprintf("Priority inversion test done.\n");
+
+	return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Spinlock contention benchmark.
+ *
+ * A number of threads (eight by default) hammer one spinlock
+ * for a fixed time with a short critical section. For each thread we
+ * count acquisitions and time how long each one took to get the lock,
+ * using the timer device's realtime clock, which is accurate to a
+ * cycle. At the end we print per-thread and overall latency, plus
+ * Jain's fairness index over the per-thread acquisition counts (1.000
+ * is perfectly fair, 1/n is one thread getting everything).
+ *
+ * Which spinlock implementation is measured is a kernel config choice
+ * (see spinlock.c); build with each to compare.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SP_MAXTHREADS	32
+#define SP_NTHREADS	8
+#define SP_SECONDS	2
+#define SP_HOLDLOOPS	50
+
+struct spstats {
+	unsigned ss_acquires;
+	uint64_t ss_waitns;		/* Total time spent acquiring */
+	uint32_t ss_maxwaitns;		/* Longest single acquire */
+};
+
+static struct spinlock sptestlock = SPINLOCK_INITIALIZER;
+static struct spstats spstats[SP_MAXTHREADS];
+static struct semaphore *spdonesem;
+static volatile bool spdone;
+static volatile unsigned long spcounter;
+
+static
+uint64_t
+sp_nsecs(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+spthread(void *junk, unsigned long num)
+{
+	struct spstats *st = &spstats[num];
+	uint64_t before, after;
+	uint32_t wait;
+	volatile int i;
+
+	(void)junk;
+
+	while (!spdone) {
+		before = sp_nsecs();
+		spinlock_acquire(&sptestlock);
+		after = sp_nsecs();
+		spcounter++;
+		for (i=0; i<SP_HOLDLOOPS; i++);
+		spinlock_release(&sptestlock);
+
+		wait = after - before;
+		st->ss_acquires++;
+		st->ss_waitns += wait;
+		if (wait > st->ss_maxwaitns) {
+			st->ss_maxwaitns = wait;
+		}
+	}
+
+	V(spdonesem);
+	thread_exit();
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	unsigned long i, nthreads;
+	unsigned total, maxwait;
+	uint64_t waitns, sumsq;
+	int result;
+
+	if (nargs == 1) {
+		nthreads = SP_NTHREADS;
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0 &&
+		 atoi(args[1]) <= SP_MAXTHREADS) {
+		nthreads = atoi(args[1]);
+	}
+	else {
+		kprintf("Usage: sl1 [nthreads (1-%d)]\n", SP_MAXTHREADS);
+		return 1;
+	}
+
+	spdonesem = sem_create("spdone", 0);
+	if (spdonesem == NULL) {
+		panic("spinlocktest: sem_create failed\n");
+	}
+	bzero(spstats, sizeof(spstats));
+	spdone = false;
+	spcounter = 0;
+
+	kprintf("Starting %s spinlock benchmark: %lu threads, %d seconds\n",
+		SPINLOCK_KIND, nthreads, SP_SECONDS);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinlocktest", NULL, spthread, NULL, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	clocksleep(SP_SECONDS);
+	spdone = true;
+	for (i=0; i<nthreads; i++) {
+		P(spdonesem);
+	}
+	sem_destroy(spdonesem);
+
+	total = 0;
+	maxwait = 0;
+	waitns = 0;
+	sumsq = 0;
+	for (i=0; i<nthreads; i++) {
+		kprintf("thread %2lu: %7u acquires, avg wait %6llu ns, "
+			"max %8u ns\n", i, spstats[i].ss_acquires,
+			spstats[i].ss_acquires ?
+			spstats[i].ss_waitns / spstats[i].ss_acquires : 0,
+			spstats[i].ss_maxwaitns);
+		total += spstats[i].ss_acquires;
+		waitns += spstats[i].ss_waitns;
+		sumsq += (uint64_t)spstats[i].ss_acquires *
+			spstats[i].ss_acquires;
+		if (spstats[i].ss_maxwaitns > maxwait) {
+			maxwait = spstats[i].ss_maxwaitns;
+		}
+	}
+	KASSERT(total == spcounter);
+
+	kprintf("total: %u acquires, avg wait %llu ns, max %u ns\n", total,
+		total ? waitns / total : 0, maxwait);
+	kprintf("fairness (Jain's index): %llu/1000\n",
+		sumsq ? (uint64_t)total * total * 1000 / (nthreads * sumsq)
+		: 0);
+	kprintf("Spinlock benchmark done.\n");
+
+	return 0;
+}
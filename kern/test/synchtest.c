@@ -42,6 +42,9 @@
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
 #define NTHREADS      32
+#define NRWLOOPS      2000
+#define NRWWRITES     20
+#define NRWREADERS    8
 
 static volatile unsigned long testval1;
 static volatile unsigned long testval2;
@@ -248,6 +251,7 @@ locktest(int nargs, char **args)
 		P(donesem);
 	}
 
+	lock_printstats(testlock);
 #ifdef UW
   cleanitems();
 #endif
@@ -340,6 +344,7 @@ cvtest(int nargs, char **args)
 		P(donesem);
 	}
 
+	cv_printstats(testcv);
 #ifdef UW
   cleanitems();
 #endif
@@ -347,3 +352,140 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. Readers check that they never see a write
+ * half-done; one writer runs alongside, alternating between plain
+ * writes and upgrade/downgrade. The same read load is run with 1, 2,
+ * 4, ... reader threads, and the read throughput printed, so one can
+ * see it scale with the number of cpus.
+ */
+
+static struct rwlock *testrw;
+
+static
+void
+rwtestreader(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	unsigned long val;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		rwlock_acquire_read(testrw);
+		val = testval1;
+		for (j=0; j<100; j++);
+		if (testval2 != val) {
+			panic("rwtest: reader saw a write in progress\n");
+		}
+		rwlock_release_read(testrw);
+	}
+	V(donesem);
+	thread_exit();
+}
+
+static
+void
+rwtestwriter(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NRWWRITES; i++) {
+		if (i % 2 == 0) {
+			rwlock_acquire_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			rwlock_upgrade(testrw);
+		}
+		KASSERT(rwlock_do_i_write(testrw));
+		testval1++;
+		for (j=0; j<1000; j++);
+		testval2++;
+		if (i % 2 == 0) {
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_downgrade(testrw);
+			KASSERT(testval1 == testval2);
+			rwlock_release_read(testrw);
+		}
+		for (j=0; j<10000; j++);
+	}
+	V(donesem);
+	thread_exit();
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	unsigned long i, nreaders, maxreaders;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs, msecs, reads;
+	int result;
+
+	if (nargs == 1) {
+		maxreaders = NRWREADERS;
+	}
+	else if (nargs == 2 && atoi(args[1]) > 0) {
+		maxreaders = atoi(args[1]);
+	}
+	else {
+		kprintf("Usage: sy4 [maxreaders]\n");
+		return 1;
+	}
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	kprintf("Starting rwlock test...\n");
+
+	testval1 = testval2 = 0;
+	for (nreaders=1; nreaders<=maxreaders; nreaders*=2) {
+		gettime(&secs1, &nsecs1);
+		result = thread_fork("rwtest", NULL, rwtestwriter, NULL, 0);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+		for (i=0; i<nreaders; i++) {
+			result = thread_fork("rwtest", NULL, rwtestreader,
+					     NULL, i);
+			if (result) {
+				panic("rwtest: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nreaders+1; i++) {
+			P(donesem);
+		}
+		gettime(&secs2, &nsecs2);
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+		msecs = secs*1000 + nsecs/1000000;
+		reads = nreaders * NRWLOOPS;
+		kprintf("%2lu readers: %u reads in %lu.%03u sec, "
+			"%u reads/sec\n", nreaders, reads,
+			(unsigned long)secs, nsecs/1000000,
+			msecs ? reads*1000/msecs : 0);
+	}
+
+	KASSERT(testval1 == testval2);
+	rwlock_destroy(testrw);
+	testrw = NULL;
+#ifdef UW
+	cleanitems();
+#endif
+	kprintf("rwlock test done.\n");
+
+	return 0;
+}
@@ -34,14 +34,15 @@
 #include <clock.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
+#include <mainbus.h>
 #include <current.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * This is pretty primitive. Callouts (below) let us schedule
+ * callbacks to happen at specific points in the future, but only with
+ * timer-tick resolution.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -54,24 +55,34 @@
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
-/*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
- */
-static struct wchan *lbolt;
-/*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
- */
-static struct wchan *minibolt;
-
 /* 
- * number of minibolts per second
+ * number of timer ticks per second
  */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+#define MINI_PER_SECOND (1000000/LT_GRANULARITY)
 
 /*
- * minibolt countdown
+ * Callouts are kept on a hierarchical timing wheel. Level 0 has one
+ * slot per tick; each slot at level L covers 64^L ticks. A callout
+ * goes in the lowest level whose span covers its delay, and when the
+ * level below wraps around the next slot up is "cascaded", i.e. its
+ * callouts are redistributed to the lower levels. So scheduling and
+ * cancelling are O(1), and each tick only looks at callouts that are
+ * actually due (plus the occasional cascade).
+ *
+ * Four levels of 64 slots cover 2^24 ticks (about 46 hours at the
+ * default granularity); longer delays are parked in the top level and
+ * reinserted when they come around.
  */
-static int minicount;
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1U << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_SPAN(level) (1U << (WHEEL_BITS * ((level) + 1)))
+
+static struct callout *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+static struct callout *callout_due;	/* expired, handler not yet run */
+static volatile unsigned callout_now;	/* ticks processed so far */
+static struct spinlock callout_lock = SPINLOCK_NAMED_INITIALIZER("callout");
 
 /*
  * Setup.
@@ -79,33 +90,211 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	/* we assume MINI_PER_SECOND > 0 */
+	KASSERT(MINI_PER_SECOND > 0);
+}
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_expire = 0;
+	co->co_pending = false;
+	co->co_func = func;
+	co->co_arg = arg;
+}
+
+/* Put CO on the list at *SLOT (a wheel slot or the due list). */
+static
+void
+callout_link(struct callout **slot, struct callout *co)
+{
+	co->co_next = *slot;
+	co->co_prevp = slot;
+	if (*slot != NULL) {
+		(*slot)->co_prevp = &co->co_next;
 	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
+	*slot = co;
+	co->co_pending = true;
+}
+
+/* Put CO in the right wheel slot for its expiry time. */
+static
+void
+wheel_insert(struct callout *co)
+{
+	unsigned delta, expire, level;
+	struct callout **slot;
+
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+
+	expire = co->co_expire;
+	delta = expire - callout_now;
+	if ((int)delta <= 0) {
+		/*
+		 * Due now (cascading can hand us a callout on its own
+		 * expiry tick): put it in the current level 0 slot, which
+		 * timerclock looks at after doing the cascades.
+		 */
+		expire = callout_now;
+		delta = 0;
 	}
-	minicount = MINI_PER_SECOND;
-	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < WHEEL_SPAN(level)) {
+			break;
+		}
+	}
+	if (delta >= WHEEL_SPAN(level)) {
+		/* Too far out; park it as far out as we can. */
+		expire = callout_now + WHEEL_SPAN(level) - 1;
+	}
+
+	slot = &wheel[level][(expire >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	callout_link(slot, co);
+}
+
+static
+void
+wheel_remove(struct callout *co)
+{
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+	KASSERT(co->co_pending);
+
+	*co->co_prevp = co->co_next;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = co->co_prevp;
+	}
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_pending = false;
+}
+
+/*
+ * Arm CO to fire TICKS timer ticks from now (at least one).
+ */
+void
+callout_schedule(struct callout *co, unsigned ticks)
+{
+	KASSERT(co->co_func != NULL);
+
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	spinlock_acquire(&callout_lock);
+	if (co->co_pending) {
+		wheel_remove(co);
+	}
+	co->co_expire = callout_now + ticks;
+	wheel_insert(co);
+	spinlock_release(&callout_lock);
+}
+
+bool
+callout_stop(struct callout *co)
+{
+	bool was_pending;
+
+	spinlock_acquire(&callout_lock);
+	was_pending = co->co_pending;
+	if (was_pending) {
+		wheel_remove(co);
+	}
+	spinlock_release(&callout_lock);
+
+	return was_pending;
+}
+
+unsigned
+callout_ticks(void)
+{
+	return callout_now;
+}
+
+/*
+ * Move everything in slot INDEX of LEVEL down to where it now belongs.
+ * Returns true if the level has wrapped, so the next level up should
+ * be cascaded too.
+ */
+static
+bool
+wheel_cascade(unsigned level, unsigned index)
+{
+	struct callout *co, *next;
+
+	co = wheel[level][index];
+	wheel[level][index] = NULL;
+	for (; co != NULL; co = next) {
+		next = co->co_next;
+		co->co_pending = false;
+		wheel_insert(co);
+	}
+	return index == 0;
 }
 
 /*
  * This is called once every every LT_GRANULARITY usec, on one processor,
  * by the timer code.
+ *
+ * Advance the wheel by one tick and run whatever is due. Only the
+ * callouts that have actually expired are touched, so sleepers no
+ * longer all wake up on every tick just to go back to sleep.
  */
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
+	struct callout *co, *next;
+	void (*func)(void *);
+	void *arg;
+	unsigned index, level;
+
+	spinlock_acquire(&callout_lock);
+	callout_now++;
+
+	index = callout_now & WHEEL_MASK;
+	for (level = 1; index == 0 && level < WHEEL_LEVELS; level++) {
+		index = (callout_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+		if (!wheel_cascade(level, index)) {
+			break;
+		}
+	}
+
+	/*
+	 * Collect what's due; things parked too far out are still in
+	 * level 0 occasionally and just get put back. Due callouts stay
+	 * pending, on callout_due, until their handler is about to run,
+	 * so that callout_schedule and callout_stop can still take them
+	 * off it.
+	 */
+	co = wheel[0][callout_now & WHEEL_MASK];
+	wheel[0][callout_now & WHEEL_MASK] = NULL;
+	for (; co != NULL; co = next) {
+		next = co->co_next;
+		co->co_pending = false;
+		if ((int)(co->co_expire - callout_now) > 0) {
+			wheel_insert(co);
+			continue;
+		}
+		callout_link(&callout_due, co);
 	}
+
+	/*
+	 * Run the handlers without the lock, so they can rearm or stop
+	 * callouts, taking each one off the due list (under the lock)
+	 * just before it runs. Don't touch a callout after its handler
+	 * starts; its owner may free it as soon as it has run.
+	 */
+	while (callout_due != NULL) {
+		co = callout_due;
+		wheel_remove(co);
+		func = co->co_func;
+		arg = co->co_arg;
+		spinlock_release(&callout_lock);
+		func(arg);
+		spinlock_acquire(&callout_lock);
+	}
+	spinlock_release(&callout_lock);
 }
 
 /*
@@ -115,18 +304,83 @@ timerclock(void)
 void
 hardclock(void)
 {
-	/*
-	 * Collect statistics here as desired.
-	 */
+	struct cpu *c = curcpu->c_self;
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if (c->c_tickless > 0) {
+		/* The deferred tick; the ones before it were skipped. */
+		c->c_hardclocks += c->c_tickless - 1;
+		c->c_idle_ticks += c->c_tickless - 1;
+		c->c_ticks_suppressed += c->c_tickless - 1;
+		c->c_tickless = 0;
+	}
+
+	c->c_hardclocks++;
+	if (c->c_isidle) {
+		/*
+		 * Interrupted the idle loop. Nothing is queued, so there
+		 * is nothing to schedule or charge, and the idle loop does
+		 * its own stealing once we return.
+		 */
+		c->c_idle_ticks++;
+		return;
+	}
+
+	if ((c->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	if ((c->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	thread_timeslice();
+}
+
+/*
+ * Dynamic ticks for an idle cpu.
+ *
+ * While the cpu is idle the only periodic work it has is the next
+ * work-stealing attempt, which the caller passes as MAXTICKS (callouts
+ * run off timerclock, not hardclock). So rather than waking up every
+ * tick just to go back to sleep, push the timer out to then. Threads
+ * made runnable here send an IPI, which ends the nap early; in that
+ * case the ticks that went by are credited now.
+ */
+void
+hardclock_idle(unsigned maxticks)
+{
+	struct cpu *c = curcpu->c_self;
+	unsigned elapsed;
+
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(c->c_isidle);
+	KASSERT(c->c_tickless == 0);
+
+	if (maxticks <= 1) {
+		cpu_idle();
+		return;
+	}
+
+	c->c_tickless = maxticks;
+	mainbus_timer_defer(maxticks);
+	cpu_idle();
+
+	if (c->c_tickless > 0) {
+		/* Woken by something other than the deferred tick. */
+		elapsed = mainbus_timer_resume();
+		c->c_tickless = 0;
+		c->c_hardclocks += elapsed;
+		c->c_idle_ticks += elapsed;
+		c->c_ticks_suppressed += elapsed;
+	}
+}
+
+/*
+ * Callout handler for clocknap: wake the napping thread.
+ */
+static
+void
+clocknap_wakeup(void *data)
+{
+	wchan_wakeone(data);
 }
 
 /*
@@ -135,23 +389,42 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clocknap(num_secs * MINI_PER_SECOND);
+	}
 }
 
 /*
  * Suspend execution for num_ticks timer ticks.
  *  (one tick every LT_GRANULARITY usec)
+ *
+ * Each thread naps on its own wait channel, created the first time it
+ * naps, and a callout wakes exactly that thread at the deadline.
  */
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	struct callout co;
+	struct wchan *wc;
+
+	if (num_ticks <= 0) {
+		return;
+	}
+
+	if (curthread->t_napchan == NULL) {
+		curthread->t_napchan = wchan_create("clocknap");
+		if (curthread->t_napchan == NULL) {
+			panic("clocknap: Out of memory\n");
+		}
+	}
+	wc = curthread->t_napchan;
+
+	/*
+	 * Hold the channel locked from before arming the callout until
+	 * we're asleep on it, so the wakeup can't get in first.
+	 */
+	callout_init(&co, clocknap_wakeup, wc);
+	wchan_lock(wc);
+	callout_schedule(&co, num_ticks);
+	wchan_sleep(wc);
 }
@@ -0,0 +1,260 @@
+/*
+ * Lock contention statistics. See lockstat.h.
+ *
+ * The records live in a fixed table in the BSS, so that looking one up
+ * never needs kmalloc (which takes a spinlock). For the same reason
+ * the table and each record are protected by bare test-and-set words
+ * rather than spinlocks, with interrupts off while they're held.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <lockstat.h>
+
+#define LOCKSTAT_MAX		256	/* Distinct names we can track */
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat {
+	volatile spinlock_data_t ls_lock;
+	unsigned ls_kind;
+	char ls_name[LOCKSTAT_NAMELEN];	/* Empty if keyed by caller */
+	vaddr_t ls_caller;
+	unsigned ls_acquires;
+	unsigned ls_contended;
+	uint64_t ls_waitns;
+	uint64_t ls_maxwaitns;
+	uint64_t ls_holdns;
+	uint64_t ls_maxholdns;
+};
+
+volatile bool lockstat_enabled;
+
+static struct lockstat lockstat_table[LOCKSTAT_MAX];
+static unsigned lockstat_count;
+static unsigned lockstat_overflows;
+static volatile spinlock_data_t lockstat_tablelock;
+
+/* Snapshot for printing; only used by lockstat_print. */
+static struct lockstat lockstat_snap[LOCKSTAT_MAX];
+
+static
+int
+rawlock(volatile spinlock_data_t *word)
+{
+	int spl;
+
+	spl = splhigh();
+	while (spinlock_data_get(word) != 0 ||
+	       spinlock_data_testandset(word) != 0) {
+		/* spin */
+	}
+	return spl;
+}
+
+static
+void
+rawunlock(volatile spinlock_data_t *word, int spl)
+{
+	spinlock_data_set(word, 0);
+	splx(spl);
+}
+
+/*
+ * Compare a stored (possibly truncated) name with a lock's name.
+ */
+static
+bool
+lockstat_samename(const char *stored, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN - 1; i++) {
+		if (stored[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+uint64_t
+lockstat_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+struct lockstat *
+lockstat_get(unsigned kind, const char *name, vaddr_t caller)
+{
+	struct lockstat *ls;
+	unsigned i;
+	int spl;
+
+	if (name != NULL && *name == 0) {
+		name = NULL;
+	}
+
+	spl = rawlock(&lockstat_tablelock);
+	for (i=0; i<lockstat_count; i++) {
+		ls = &lockstat_table[i];
+		if (ls->ls_kind != kind) {
+			continue;
+		}
+		if (name != NULL ? lockstat_samename(ls->ls_name, name)
+		    : (ls->ls_name[0] == 0 && ls->ls_caller == caller)) {
+			rawunlock(&lockstat_tablelock, spl);
+			return ls;
+		}
+	}
+
+	if (lockstat_count == LOCKSTAT_MAX) {
+		lockstat_overflows++;
+		rawunlock(&lockstat_tablelock, spl);
+		return NULL;
+	}
+
+	ls = &lockstat_table[lockstat_count++];
+	bzero(ls, sizeof(*ls));
+	ls->ls_kind = kind;
+	if (name != NULL) {
+		for (i=0; i<LOCKSTAT_NAMELEN - 1 && name[i] != 0; i++) {
+			ls->ls_name[i] = name[i];
+		}
+	}
+	else {
+		ls->ls_caller = caller;
+	}
+	rawunlock(&lockstat_tablelock, spl);
+	return ls;
+}
+
+void
+lockstat_acquired(struct lockstat *ls, bool contended, uint64_t waitns)
+{
+	int spl;
+
+	spl = rawlock(&ls->ls_lock);
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_waitns += waitns;
+		if (waitns > ls->ls_maxwaitns) {
+			ls->ls_maxwaitns = waitns;
+		}
+	}
+	rawunlock(&ls->ls_lock, spl);
+}
+
+void
+lockstat_released(struct lockstat *ls, uint64_t holdns)
+{
+	int spl;
+
+	spl = rawlock(&ls->ls_lock);
+	ls->ls_holdns += holdns;
+	if (holdns > ls->ls_maxholdns) {
+		ls->ls_maxholdns = holdns;
+	}
+	rawunlock(&ls->ls_lock, spl);
+}
+
+void
+lockstat_enable(bool on)
+{
+	lockstat_enabled = on;
+}
+
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+	int spl, spl2;
+
+	spl = rawlock(&lockstat_tablelock);
+	for (i=0; i<lockstat_count; i++) {
+		ls = &lockstat_table[i];
+		spl2 = rawlock(&ls->ls_lock);
+		ls->ls_acquires = 0;
+		ls->ls_contended = 0;
+		ls->ls_waitns = 0;
+		ls->ls_maxwaitns = 0;
+		ls->ls_holdns = 0;
+		ls->ls_maxholdns = 0;
+		rawunlock(&ls->ls_lock, spl2);
+	}
+	lockstat_overflows = 0;
+	rawunlock(&lockstat_tablelock, spl);
+}
+
+void
+lockstat_print(void)
+{
+	static const char *const kinds[] = { "spin", "lock", "cv" };
+	struct lockstat *ls, tmp;
+	unsigned i, j, n, overflows;
+	char name[LOCKSTAT_NAMELEN];
+	int spl, spl2;
+
+	/*
+	 * Copy the table first: kprintf takes locks, which would want
+	 * to record statistics while we held the table.
+	 */
+	spl = rawlock(&lockstat_tablelock);
+	n = lockstat_count;
+	for (i=0; i<n; i++) {
+		ls = &lockstat_table[i];
+		spl2 = rawlock(&ls->ls_lock);
+		lockstat_snap[i] = *ls;
+		rawunlock(&ls->ls_lock, spl2);
+	}
+	overflows = lockstat_overflows;
+	rawunlock(&lockstat_tablelock, spl);
+
+	/* Sort by total wait time, biggest first. */
+	for (i=1; i<n; i++) {
+		tmp = lockstat_snap[i];
+		for (j=i; j>0 && lockstat_snap[j-1].ls_waitns < tmp.ls_waitns;
+		     j--) {
+			lockstat_snap[j] = lockstat_snap[j-1];
+		}
+		lockstat_snap[j] = tmp;
+	}
+
+	kprintf("lockstat (%s): times in usec\n",
+		lockstat_enabled ? "collecting" : "stopped");
+	kprintf("kind %-23s %9s %9s %10s %8s %10s %8s\n", "name",
+		"acquires", "contended", "wait", "maxwait", "hold",
+		"maxhold");
+	for (i=0; i<n; i++) {
+		ls = &lockstat_snap[i];
+		if (ls->ls_acquires == 0) {
+			continue;
+		}
+		if (ls->ls_name[0] != 0) {
+			strcpy(name, ls->ls_name);
+		}
+		else {
+			snprintf(name, sizeof(name), "(at 0x%x)",
+				 (unsigned)ls->ls_caller);
+		}
+		kprintf("%-4s %-23s %9u %9u %10llu %8llu %10llu %8llu\n",
+			kinds[ls->ls_kind], name, ls->ls_acquires,
+			ls->ls_contended, ls->ls_waitns / 1000,
+			ls->ls_maxwaitns / 1000, ls->ls_holdns / 1000,
+			ls->ls_maxholdns / 1000);
+	}
+	if (overflows > 0) {
+		kprintf("(%u lock names not tracked; table full)\n",
+			overflows);
+	}
+}
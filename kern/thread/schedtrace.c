@@ -0,0 +1,234 @@
+/*
+ * Scheduler latency histograms. See schedtrace.h.
+ *
+ * The scheduler hooks themselves are in thread.c, which owns the cpus;
+ * this file has the histograms and the per-process table.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <schedtrace.h>
+
+#define SCHEDTRACE_NPROCS	64
+#define SCHEDTRACE_NAMELEN	16
+
+struct schedtrace_proc {
+	char sp_name[SCHEDTRACE_NAMELEN];
+	pid_t sp_pid;			/* -1 if none */
+	bool sp_inuse;			/* Slot has ever been allocated */
+	bool sp_live;			/* Process not destroyed yet */
+	unsigned sp_serial;		/* Allocation order, for recycling */
+	struct schedtrace sp_trace;
+};
+
+volatile bool schedtrace_enabled;
+
+/*
+ * The process table. The lock is taken inside runqueue locks, so it
+ * must not be held while doing anything else.
+ */
+static struct schedtrace_proc schedtrace_procs[SCHEDTRACE_NPROCS];
+static unsigned schedtrace_serial;
+static struct spinlock schedtrace_lock =
+	SPINLOCK_NAMED_INITIALIZER("schedtrace");
+
+/* Copies for printing; only used by the print functions (the menu). */
+static struct schedtrace_proc schedtrace_snap;
+
+uint64_t
+schedtrace_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+////////////////////////////////////////////////////////////
+// histograms
+
+void
+schedtrace_clear(struct schedtrace *st)
+{
+	bzero(st, sizeof(*st));
+}
+
+void
+schedhist_add(struct schedhist *sh, uint64_t ns)
+{
+	uint32_t us;
+	unsigned b;
+
+	us = ns / 1000 > 0xffffffff ? 0xffffffff : ns / 1000;
+	for (b = 0; us > 0 && b < SCHEDHIST_BUCKETS - 1; b++) {
+		us >>= 1;
+	}
+
+	sh->sh_count++;
+	sh->sh_totalns += ns;
+	if (ns > sh->sh_maxns) {
+		sh->sh_maxns = ns;
+	}
+	sh->sh_buckets[b]++;
+}
+
+static
+void
+schedhist_print(const char *what, const struct schedhist *sh)
+{
+	unsigned b;
+
+	kprintf("    %s: %u samples", what, sh->sh_count);
+	if (sh->sh_count == 0) {
+		kprintf("\n");
+		return;
+	}
+	kprintf(", avg %llu us, max %llu us\n",
+		sh->sh_totalns / sh->sh_count / 1000, sh->sh_maxns / 1000);
+
+	for (b = 0; b < SCHEDHIST_BUCKETS; b++) {
+		if (sh->sh_buckets[b] == 0) {
+			continue;
+		}
+		if (b == 0) {
+			kprintf("        %8s < 1 us", "");
+		}
+		else if (b == SCHEDHIST_BUCKETS - 1) {
+			kprintf("        %8u+     us", 1U << (b - 1));
+		}
+		else {
+			kprintf("        %8u-%-8u us", 1U << (b - 1), 1U << b);
+		}
+		kprintf(": %u (%u%%)\n", sh->sh_buckets[b],
+			sh->sh_buckets[b] * 100 / sh->sh_count);
+	}
+}
+
+void
+schedtrace_print(const struct schedtrace *st)
+{
+	schedhist_print("run queue wait", &st->st_wait);
+	schedhist_print("timeslice", &st->st_slice);
+}
+
+////////////////////////////////////////////////////////////
+// per-process table
+
+/*
+ * Find a slot for a new process: one never used, or else the one for
+ * the process that was created longest ago among those that exited.
+ */
+struct schedtrace_proc *
+schedtrace_procalloc(const char *name, pid_t pid)
+{
+	struct schedtrace_proc *sp, *best;
+	unsigned i;
+
+	best = NULL;
+	spinlock_acquire(&schedtrace_lock);
+	for (i=0; i<SCHEDTRACE_NPROCS; i++) {
+		sp = &schedtrace_procs[i];
+		if (!sp->sp_inuse) {
+			best = sp;
+			break;
+		}
+		if (!sp->sp_live &&
+		    (best == NULL || sp->sp_serial < best->sp_serial)) {
+			best = sp;
+		}
+	}
+	if (best != NULL) {
+		bzero(best, sizeof(*best));
+		for (i=0; i<SCHEDTRACE_NAMELEN - 1 && name[i] != 0; i++) {
+			best->sp_name[i] = name[i];
+		}
+		best->sp_pid = pid;
+		best->sp_inuse = true;
+		best->sp_live = true;
+		best->sp_serial = schedtrace_serial++;
+	}
+	spinlock_release(&schedtrace_lock);
+	return best;
+}
+
+void
+schedtrace_procfree(struct schedtrace_proc *sp)
+{
+	spinlock_acquire(&schedtrace_lock);
+	KASSERT(sp->sp_live);
+	sp->sp_live = false;
+	spinlock_release(&schedtrace_lock);
+}
+
+void
+schedtrace_procrecord(struct schedtrace_proc *sp, bool slice, uint64_t ns)
+{
+	if (sp == NULL) {
+		return;
+	}
+	spinlock_acquire(&schedtrace_lock);
+	schedhist_add(slice ? &sp->sp_trace.st_slice : &sp->sp_trace.st_wait,
+		      ns);
+	spinlock_release(&schedtrace_lock);
+}
+
+void
+schedtrace_enable(bool on)
+{
+	schedtrace_enabled = on;
+}
+
+/*
+ * Clear the histograms, and forget processes that have exited.
+ */
+void
+schedtrace_procreset(void)
+{
+	struct schedtrace_proc *sp;
+	unsigned i;
+
+	spinlock_acquire(&schedtrace_lock);
+	for (i=0; i<SCHEDTRACE_NPROCS; i++) {
+		sp = &schedtrace_procs[i];
+		if (sp->sp_live) {
+			schedtrace_clear(&sp->sp_trace);
+		}
+		else {
+			sp->sp_inuse = false;
+		}
+	}
+	spinlock_release(&schedtrace_lock);
+}
+
+void
+schedtrace_procprint(void)
+{
+	unsigned i;
+
+	for (i=0; i<SCHEDTRACE_NPROCS; i++) {
+		spinlock_acquire(&schedtrace_lock);
+		schedtrace_snap = schedtrace_procs[i];
+		spinlock_release(&schedtrace_lock);
+
+		if (!schedtrace_snap.sp_inuse) {
+			continue;
+		}
+		if (schedtrace_snap.sp_trace.st_wait.sh_count == 0 &&
+		    schedtrace_snap.sp_trace.st_slice.sh_count == 0) {
+			continue;
+		}
+		if (schedtrace_snap.sp_pid >= 0) {
+			kprintf("process %d (%s)%s:\n", schedtrace_snap.sp_pid,
+				schedtrace_snap.sp_name,
+				schedtrace_snap.sp_live ? "" : ", exited");
+		}
+		else {
+			kprintf("process %s%s:\n", schedtrace_snap.sp_name,
+				schedtrace_snap.sp_live ? "" : ", exited");
+		}
+		schedtrace_print(&schedtrace_snap.sp_trace);
+	}
+}
@@ -36,11 +36,150 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>	/* for curcpu */
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 
 /*
  * Spinlocks.
+ *
+ * The default is test-and-test-and-set: simple and cheap when
+ * uncontended, but unfair (whichever cpu's test-and-set happens to
+ * land first wins) and every waiter hammers the same word.
+ *
+ * "options ticketlock" gives ticket locks: each acquirer takes a
+ * number with an atomic increment and waits for lk_serving to reach
+ * it, so cpus get the lock in FIFO order. Waiters still all read the
+ * same word, but only the release writes it.
+ *
+ * "options mcslock" gives MCS queue locks: each acquirer appends a
+ * node of its own to a queue and spins on a flag in that node, which
+ * its predecessor clears when releasing. So it is FIFO and each
+ * waiter spins on a different word. Nodes come from a small pool in
+ * each cpu (a cpu can hold several spinlocks at once, and need not
+ * release them in order), and the holder's node is remembered in the
+ * lock for the release.
  */
 
+#if OPT_MCSLOCK
+/* Node pool for before curcpu is set up (only the boot cpu runs then) */
+static struct mcsnode mcs_bootnodes[MCS_NODES];
+static uint32_t mcs_bootfree = (1U << MCS_NODES) - 1;
+
+/*
+ * Get a free node from this cpu's pool. Interrupts must be off.
+ */
+static
+struct mcsnode *
+mcs_getnode(void)
+{
+	struct mcsnode *pool;
+	uint32_t *freep;
+	unsigned i;
+
+	if (CURCPU_EXISTS()) {
+		pool = curcpu->c_mcsnodes;
+		freep = &curcpu->c_mcsfree;
+	}
+	else {
+		pool = mcs_bootnodes;
+		freep = &mcs_bootfree;
+	}
+
+	if (*freep == 0) {
+		panic("spinlock: cpu holds too many spinlocks\n");
+	}
+	for (i=0; (*freep & (1U << i)) == 0; i++) {
+		/* nothing */
+	}
+	*freep &= ~(1U << i);
+	return &pool[i];
+}
+
+/*
+ * Return a node to the pool it came from; that's this cpu's, since
+ * spinlocks are released by the cpu that acquired them.
+ */
+static
+void
+mcs_putnode(struct mcsnode *node)
+{
+	if (node >= mcs_bootnodes && node < mcs_bootnodes + MCS_NODES) {
+		mcs_bootfree |= 1U << (node - mcs_bootnodes);
+	}
+	else {
+		KASSERT(node >= curcpu->c_mcsnodes &&
+			node < curcpu->c_mcsnodes + MCS_NODES);
+		curcpu->c_mcsfree |= 1U << (node - curcpu->c_mcsnodes);
+	}
+}
+#endif /* OPT_MCSLOCK */
+
+#if OPT_LOCKSTAT
+/*
+ * Lockstat hooks. Timing starts before we go for the lock; whether
+ * the acquisition counts as contended is up to the implementation
+ * (it is if we couldn't take the lock on the first try).
+ */
+static
+uint64_t
+spinlock_stat_begin(void)
+{
+	if (!lockstat_enabled || !CURCPU_EXISTS()) {
+		return 0;
+	}
+	return lockstat_now();
+}
+
+static
+void
+spinlock_stat_acquired(struct spinlock *lk, uint64_t start, bool contended,
+		       vaddr_t caller)
+{
+	uint64_t now;
+
+	lk->lk_acqtime = 0;
+	if (start == 0 || !lockstat_enabled) {
+		return;
+	}
+	if (lk->lk_stat == NULL) {
+		lk->lk_stat = lockstat_get(LOCKSTAT_SPINLOCK, lk->lk_name,
+					   caller);
+		if (lk->lk_stat == NULL) {
+			return;
+		}
+	}
+	now = lockstat_now();
+	lockstat_acquired(lk->lk_stat, contended, now - start);
+	lk->lk_acqtime = now;
+}
+
+static
+void
+spinlock_stat_release(struct spinlock *lk)
+{
+	if (lk->lk_acqtime != 0 && lockstat_enabled) {
+		lockstat_released(lk->lk_stat,
+				  lockstat_now() - lk->lk_acqtime);
+	}
+	lk->lk_acqtime = 0;
+}
+
+/*
+ * Name a spinlock.
+ */
+void
+spinlock_setname(struct spinlock *lk, const char *name)
+{
+	lk->lk_name = name;
+	lk->lk_stat = NULL;
+}
+#else
+#define spinlock_stat_begin()			0
+#define spinlock_stat_acquired(lk, start, contended, caller) \
+	((void)(start), (void)(contended), (void)(caller))
+#define spinlock_stat_release(lk)		((void)(lk))
+#endif /* OPT_LOCKSTAT */
 
 /*
  * Initialize spinlock.
@@ -48,8 +187,21 @@
 void
 spinlock_init(struct spinlock *lk)
 {
+#if OPT_TICKETLOCK
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
+#elif OPT_MCSLOCK
+	spinlock_data_set(&lk->lk_tail, 0);
+	lk->lk_node = NULL;
+#else
 	spinlock_data_set(&lk->lk_lock, 0);
+#endif
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_name = NULL;
+	lk->lk_stat = NULL;
+	lk->lk_acqtime = 0;
+#endif
 }
 
 /*
@@ -59,7 +211,14 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
+#if OPT_TICKETLOCK
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
+#elif OPT_MCSLOCK
+	KASSERT(spinlock_data_get(&lk->lk_tail) == 0);
+#else
 	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+#endif
 }
 
 /*
@@ -73,6 +232,13 @@ void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	uint64_t start;
+	bool contended;
+#if OPT_TICKETLOCK
+	spinlock_data_t ticket;
+#elif OPT_MCSLOCK
+	struct mcsnode *node, *pred;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,6 +253,31 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+	start = spinlock_stat_begin();
+	contended = false;
+
+#if OPT_TICKETLOCK
+	ticket = spinlock_data_fetchadd(&lk->lk_next, 1);
+	contended = spinlock_data_get(&lk->lk_serving) != ticket;
+	while (spinlock_data_get(&lk->lk_serving) != ticket) {
+		/* spin */
+	}
+#elif OPT_MCSLOCK
+	node = mcs_getnode();
+	spinlock_data_set(&node->mn_next, 0);
+	spinlock_data_set(&node->mn_wait, 1);
+	pred = (struct mcsnode *)spinlock_data_swap(&lk->lk_tail,
+						    (spinlock_data_t)node);
+	if (pred != NULL) {
+		contended = true;
+		/* Get in line behind pred and wait for it to wave us in. */
+		spinlock_data_set(&pred->mn_next, (spinlock_data_t)node);
+		while (spinlock_data_get(&node->mn_wait) != 0) {
+			/* spin */
+		}
+	}
+	lk->lk_node = node;
+#else
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -99,15 +290,20 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		break;
 	}
+#endif
 
 	lk->lk_holder = mycpu;
+	spinlock_stat_acquired(lk, start, contended,
+			       (vaddr_t)__builtin_return_address(0));
 }
 
 /*
@@ -116,13 +312,43 @@ spinlock_acquire(struct spinlock *lk)
 void
 spinlock_release(struct spinlock *lk)
 {
+#if OPT_MCSLOCK
+	struct mcsnode *node, *next;
+#endif
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+	spinlock_stat_release(lk);
 	lk->lk_holder = NULL;
+#if OPT_TICKETLOCK
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
+#elif OPT_MCSLOCK
+	node = lk->lk_node;
+	lk->lk_node = NULL;
+	next = (struct mcsnode *)spinlock_data_get(&node->mn_next);
+	if (next == NULL) {
+		/* Nobody behind us, unless someone is just joining. */
+		if (spinlock_data_cas(&lk->lk_tail, (spinlock_data_t)node, 0)
+		    == (spinlock_data_t)node) {
+			mcs_putnode(node);
+			spllower(IPL_HIGH, IPL_NONE);
+			return;
+		}
+		/* Someone is; wait for them to link in. */
+		do {
+			next = (struct mcsnode *)
+				spinlock_data_get(&node->mn_next);
+		} while (next == NULL);
+	}
+	spinlock_data_set(&next->mn_wait, 0);
+	mcs_putnode(node);
+#else
 	spinlock_data_set(&lk->lk_lock, 0);
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
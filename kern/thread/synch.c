@@ -35,8 +35,12 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
 #include <wchan.h>
 #include <thread.h>
+#if OPT_LOCKSTAT
+#include <lockstat.h>
+#endif
 #include <current.h>
 #include <synch.h>
 
@@ -70,6 +74,7 @@ sem_create(const char *name, int initial_count)
 	}
 
 	spinlock_init(&sem->sem_lock);
+	spinlock_setname(&sem->sem_lock, sem->sem_name);
         sem->sem_count = initial_count;
 
         return sem;
@@ -147,6 +152,42 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks are adaptive: a thread that finds the lock held spins for a
+ * while, as long as the holder is running on another cpu, before
+ * going to sleep. Most critical sections are short, so the holder is
+ * likely to let go well before two context switches' worth of time.
+ * If the holder isn't running it can't release the lock until it's
+ * rescheduled, so there's no point spinning.
+ */
+#define LOCK_SPIN_MAX	1000	/* Checks of the holder before sleeping */
+
+/*
+ * Priority inheritance. A thread about to sleep on a lock lends its
+ * scheduling level to the holder, so a low-priority holder can't be
+ * kept off the cpu by medium-priority threads while a high-priority
+ * one waits for it. If the holder is itself asleep on another lock,
+ * the loan is passed along to that lock's holder, and so on (up to
+ * LOCK_PI_MAXDEPTH, in case of a deadlock cycle).
+ *
+ * lk_prio is the best level lent through the lock, or SCHED_NOPRIO if
+ * nobody is sleeping on it; a thread's t_inherit is the best lk_prio
+ * of the locks it holds. Both are recomputed when a lock is released
+ * while others are asleep on it.
+ *
+ * The chains cross locks, so they are protected by one global
+ * spinlock, lock_pi_lock. To keep it off the uncontended path: while
+ * lk_prio is SCHED_NOPRIO it only changes with the lock's own
+ * spinlock held; while it isn't, lk_prio and the holder only change
+ * with lock_pi_lock held too. So following holder/t_blocked_on links
+ * under lock_pi_lock only ever finds threads that really are holding
+ * (and so can't exit) or waiting. Lock order is lock->sl, then
+ * lock_pi_lock, then wait channel and run queue locks.
+ */
+#define LOCK_PI_MAXDEPTH	8
+
+static struct spinlock lock_pi_lock = SPINLOCK_NAMED_INITIALIZER("lock_pi");
+
 struct lock *
 lock_create(const char *name)
 {
@@ -167,6 +208,16 @@ lock_create(const char *name)
         lock -> wc = wchan_create(lock -> lk_name);
         lock -> holder = NULL;
         spinlock_init(&lock -> sl);
+        spinlock_setname(&lock->sl, lock->lk_name);
+        lock->lk_prio = SCHED_NOPRIO;
+        lock->lk_nextheld = NULL;
+        lock->lk_acquires = 0;
+        lock->lk_spins = 0;
+        lock->lk_sleeps = 0;
+#if OPT_LOCKSTAT
+        lock->lk_stat = NULL;
+        lock->lk_acqtime = 0;
+#endif
         return lock;
 }
 
@@ -182,34 +233,263 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/*
+ * Spin while the lock's holder is running on another cpu. Returns true
+ * if the lock came free, false if we should sleep instead.
+ *
+ * The holder's thread is examined without any locking, so it may have
+ * released the lock, exited, and been freed by the time we look. That
+ * only affects the decision to keep spinning, and we recheck the
+ * holder on every pass.
+ */
+static
+bool
+lock_spin(struct lock *lock)
+{
+	struct thread volatile *owner;
+	unsigned i;
+
+	for (i=0; i<LOCK_SPIN_MAX; i++) {
+		owner = lock->holder;
+		if (owner == NULL) {
+			return true;
+		}
+		if (owner->t_state != S_RUN ||
+		    owner->t_cpu == curcpu->c_self) {
+			return false;
+		}
+	}
+	return false;
+}
+
+/*
+ * Lend LEVEL to the holder of LOCK, and onwards down the chain.
+ */
+static
+void
+lock_lend(struct lock *lock, unsigned level)
+{
+	struct thread *holder;
+	unsigned depth;
+
+	KASSERT(spinlock_do_i_hold(&lock_pi_lock));
+
+	for (depth = 0; depth < LOCK_PI_MAXDEPTH; depth++) {
+		if (lock->lk_prio <= level) {
+			/* Already lent at least this much. */
+			return;
+		}
+		lock->lk_prio = level;
+		holder = (struct thread *)lock->holder;
+		if (holder == NULL) {
+			/* Just released; the next holder picks it up. */
+			return;
+		}
+		if (holder->t_inherit > level) {
+			thread_set_inherited(holder, level);
+		}
+		lock = holder->t_blocked_on;
+		if (lock == NULL || lock->lk_prio == SCHED_NOPRIO) {
+			/* Not waiting (any more) */
+			return;
+		}
+	}
+}
+
+/*
+ * Recompute what the current thread inherits from the locks it holds.
+ */
+static
+void
+lock_reinherit(void)
+{
+	struct lock *held;
+	unsigned level;
+
+	KASSERT(spinlock_do_i_hold(&lock_pi_lock));
+
+	level = SCHED_NOPRIO;
+	for (held = curthread->t_heldlocks; held != NULL;
+	     held = held->lk_nextheld) {
+		if (held->lk_prio < level) {
+			level = held->lk_prio;
+		}
+	}
+	if (curthread->t_inherit != level) {
+		thread_set_inherited(curthread, level);
+	}
+}
+
+#if OPT_LOCKSTAT
+/*
+ * Lockstat hooks for locks and CVs. A lock acquisition counts as
+ * contended if it had to spin or sleep; the wait runs from the call
+ * to lock_acquire. For CVs every cv_wait is a wait, until the lock is
+ * ours again (with wait morphing the two are hard to tell apart).
+ */
+static
+uint64_t
+synch_stat_begin(void)
+{
+	return lockstat_enabled ? lockstat_now() : 0;
+}
+
+static
+void
+lock_stat_acquired(struct lock *lock, uint64_t start, bool contended)
+{
+	uint64_t now;
+
+	KASSERT(spinlock_do_i_hold(&lock->sl));
+
+	lock->lk_acqtime = 0;
+	if (start == 0 || !lockstat_enabled) {
+		return;
+	}
+	if (lock->lk_stat == NULL) {
+		lock->lk_stat = lockstat_get(LOCKSTAT_LOCK, lock->lk_name, 0);
+		if (lock->lk_stat == NULL) {
+			return;
+		}
+	}
+	now = lockstat_now();
+	lockstat_acquired(lock->lk_stat, contended, now - start);
+	lock->lk_acqtime = now;
+}
+
+static
+void
+lock_stat_release(struct lock *lock)
+{
+	KASSERT(spinlock_do_i_hold(&lock->sl));
+
+	if (lock->lk_acqtime != 0 && lockstat_enabled) {
+		lockstat_released(lock->lk_stat,
+				  lockstat_now() - lock->lk_acqtime);
+	}
+	lock->lk_acqtime = 0;
+}
+
+static
+void
+cv_stat_woken(struct cv *cv, uint64_t start)
+{
+	if (start == 0 || !lockstat_enabled) {
+		return;
+	}
+	/* Only threads holding the lock get here, so that protects this */
+	if (cv->cv_stat == NULL) {
+		cv->cv_stat = lockstat_get(LOCKSTAT_CV, cv->cv_name, 0);
+		if (cv->cv_stat == NULL) {
+			return;
+		}
+	}
+	lockstat_acquired(cv->cv_stat, true, lockstat_now() - start);
+}
+#else
+#define synch_stat_begin()			0
+#define lock_stat_acquired(lock, start, contended) \
+	((void)(start), (void)(contended))
+#define lock_stat_release(lock)			((void)(lock))
+#define cv_stat_woken(cv, start)		((void)(start))
+#endif /* OPT_LOCKSTAT */
+
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
-        spinlock_acquire(&lock -> sl);
-        while (lock -> holder != NULL) {
-                wchan_lock(lock -> wc);
-                spinlock_release(&lock -> sl);
-                wchan_sleep(lock -> wc);
-                spinlock_acquire(&lock -> sl);
-        }
-        lock -> holder = curthread;
-        spinlock_release(&lock -> sl);
-        // (void)lock;  // suppress warning until code gets written
+	bool spun = false, slept = false;
+	uint64_t start;
+
+	start = synch_stat_begin();
+	spinlock_acquire(&lock->sl);
+	while (lock->holder != NULL) {
+		spinlock_release(&lock->sl);
+		spun = true;
+		if (lock_spin(lock)) {
+			/* Looks free; go back and try to take it. */
+			spinlock_acquire(&lock->sl);
+			continue;
+		}
+		spinlock_acquire(&lock->sl);
+		if (lock->holder == NULL) {
+			continue;
+		}
+
+		spinlock_acquire(&lock_pi_lock);
+		curthread->t_blocked_on = lock;
+		lock_lend(lock, thread_priority(curthread));
+		spinlock_release(&lock_pi_lock);
+
+		wchan_lock(lock->wc);
+		spinlock_release(&lock->sl);
+		wchan_sleep(lock->wc);
+		slept = true;
+		spinlock_acquire(&lock->sl);
+
+		spinlock_acquire(&lock_pi_lock);
+		curthread->t_blocked_on = NULL;
+		spinlock_release(&lock_pi_lock);
+	}
+
+	if (lock->lk_prio == SCHED_NOPRIO) {
+		lock->holder = curthread;
+	}
+	else {
+		/* Others are asleep on it; take over their loan. */
+		spinlock_acquire(&lock_pi_lock);
+		lock->holder = curthread;
+		if (lock->lk_prio < curthread->t_inherit) {
+			thread_set_inherited(curthread, lock->lk_prio);
+		}
+		spinlock_release(&lock_pi_lock);
+	}
+	lock->lk_nextheld = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+
+	lock->lk_acquires++;
+	if (slept) {
+		lock->lk_sleeps++;
+	}
+	else if (spun) {
+		lock->lk_spins++;
+	}
+	lock_stat_acquired(lock, start, spun || slept);
+	spinlock_release(&lock->sl);
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
-        KASSERT(lock_do_i_hold(lock));
-        spinlock_acquire(&lock -> sl);
-        KASSERT(lock -> holder == curthread);
-        lock -> holder = NULL;
-        wchan_wakeone(lock -> wc);
-        spinlock_release(&lock -> sl);
+	struct lock **pp;
 
-//        (void)lock;  // suppress warning until code gets written
+	KASSERT(lock_do_i_hold(lock));
+	spinlock_acquire(&lock->sl);
+	KASSERT(lock->holder == curthread);
+
+	for (pp = &curthread->t_heldlocks; *pp != lock;
+	     pp = &(*pp)->lk_nextheld) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = lock->lk_nextheld;
+	lock->lk_nextheld = NULL;
+	lock_stat_release(lock);
+
+	wchan_wakeone(lock->wc);
+	if (lock->lk_prio == SCHED_NOPRIO) {
+		lock->holder = NULL;
+	}
+	else {
+		/*
+		 * Give back what was lent through this lock, and work
+		 * out what the threads still asleep on it are lending.
+		 */
+		spinlock_acquire(&lock_pi_lock);
+		lock->holder = NULL;
+		lock->lk_prio = wchan_priority(lock->wc);
+		lock_reinherit();
+		spinlock_release(&lock_pi_lock);
+	}
+	spinlock_release(&lock->sl);
 }
 
 bool
@@ -224,6 +504,19 @@ lock_do_i_hold(struct lock *lock)
         return false;
 }
 
+/*
+ * Print how contended acquisitions of LOCK were resolved.
+ */
+void
+lock_printstats(struct lock *lock)
+{
+	spinlock_acquire(&lock->sl);
+	kprintf("lock %s: %u acquires, %u after spinning, "
+		"%u after sleeping\n", lock->lk_name, lock->lk_acquires,
+		lock->lk_spins, lock->lk_sleeps);
+	spinlock_release(&lock->sl);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -247,6 +540,12 @@ cv_create(const char *name)
         
         // add stuff here as needed
         cv -> wc = wchan_create(cv -> cv_name);
+        cv->cv_signals = 0;
+        cv->cv_broadcasts = 0;
+        cv->cv_morphs = 0;
+#if OPT_LOCKSTAT
+        cv->cv_stat = NULL;
+#endif
         return cv;
 }
 
@@ -267,26 +566,282 @@ cv_wait(struct cv *cv, struct lock *lock)
         // Write this
 //        (void)cv;    // suppress warning until code gets written
 //        (void)lock;  // suppress warning until code gets written
+        uint64_t start;
+
+        start = synch_stat_begin();
         wchan_lock(cv -> wc);
         lock_release(lock);
         wchan_sleep(cv -> wc);
         lock_acquire(lock);
+        cv_stat_woken(cv, start);
+}
+
+/*
+ * Wait morphing. A thread woken from a CV goes straight to
+ * lock_acquire, and since the signaller normally still holds the lock
+ * it just goes back to sleep there, costing two pointless context
+ * switches (times every waiter, for a broadcast). So if the caller
+ * holds the lock, we move the waiters from the CV's wait channel
+ * directly onto the lock's instead; lock_release then wakes them one
+ * at a time. They have not lent their priority to the holder the way
+ * they would have in lock_acquire, so do that here.
+ */
+static
+void
+cv_morph(struct cv *cv, struct lock *lock, bool all)
+{
+	unsigned moved, level;
+
+	moved = wchan_requeue(cv->wc, lock->wc, all);
+	if (moved == 0) {
+		return;
+	}
+	cv->cv_morphs += moved;
+
+	spinlock_acquire(&lock->sl);
+	level = wchan_priority(lock->wc);
+	if (level != SCHED_NOPRIO) {
+		spinlock_acquire(&lock_pi_lock);
+		lock_lend(lock, level);
+		spinlock_release(&lock_pi_lock);
+	}
+	spinlock_release(&lock->sl);
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-        // Write this
-//    (void)cv;    // suppress warning until code gets written
-    (void)lock;  // suppress warning until code gets written
-        wchan_wakeone(cv -> wc);
+	cv->cv_signals++;
+	if (lock_do_i_hold(lock)) {
+		cv_morph(cv, lock, false);
+	}
+	else {
+		wchan_wakeone(cv->wc);
+	}
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	// Write this
-//    (void)cv;    // suppress warning until code gets written
-	(void)lock;  // suppress warning until code gets written
-    wchan_wakeall(cv -> wc);
+	cv->cv_broadcasts++;
+	if (lock_do_i_hold(lock)) {
+		cv_morph(cv, lock, true);
+	}
+	else {
+		wchan_wakeall(cv->wc);
+	}
+}
+
+/*
+ * Print how many waiters were requeued rather than woken; each one
+ * is a sleep/wakeup round trip on the lock avoided.
+ */
+void
+cv_printstats(struct cv *cv)
+{
+	kprintf("cv %s: %u signals, %u broadcasts, %u waiters requeued "
+		"(context switches avoided)\n", cv->cv_name,
+		cv->cv_signals, cv->cv_broadcasts, cv->cv_morphs);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmalloc(sizeof(struct rwlock));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rw_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_writewchan = wchan_create(rw->rw_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rw_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	spinlock_init(&rw->rw_lock);
+	spinlock_setname(&rw->rw_lock, rw->rw_name);
+	rw->rw_readers = 0;
+	rw->rw_writewait = 0;
+	rw->rw_upgrading = false;
+	rw->rw_writer = NULL;
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_writewait == 0);
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+	kfree(rw->rw_name);
+	kfree(rw);
+}
+
+/*
+ * Sleep on WC. The rwlock's spinlock must be held; it is released
+ * while sleeping and held again on return.
+ */
+static
+void
+rwlock_sleep(struct rwlock *rw, struct wchan *wc)
+{
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	wchan_lock(wc);
+	spinlock_release(&rw->rw_lock);
+	wchan_sleep(wc);
+	spinlock_acquire(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	/* Writers (and an upgrade) go first. */
+	while (rw->rw_writer != NULL || rw->rw_writewait > 0 ||
+	       rw->rw_upgrading) {
+		rwlock_sleep(rw, rw->rw_readwchan);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 1 && rw->rw_upgrading) {
+		/* Only the upgrader is left; it's waiting with the writers. */
+		wchan_wakeall(rw->rw_writewchan);
+	}
+	else if (rw->rw_readers == 0 && rw->rw_writewait > 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_writewait++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		rwlock_sleep(rw, rw->rw_writewchan);
+	}
+	rw->rw_writewait--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+/*
+ * Wake whoever should get the lock next after a writer is done with
+ * it: another writer if there is one, otherwise all the readers.
+ */
+static
+void
+rwlock_wake_after_write(struct rwlock *rw)
+{
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	if (rw->rw_writewait > 0) {
+		wchan_wakeone(rw->rw_writewchan);
+	}
+	else {
+		wchan_wakeall(rw->rw_readwchan);
+	}
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	rwlock_wake_after_write(rw);
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_upgrade(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+
+	if (rw->rw_upgrading) {
+		/*
+		 * Someone else is already waiting for the other readers,
+		 * us included, to leave; we can't both win.
+		 */
+		spinlock_release(&rw->rw_lock);
+		rwlock_release_read(rw);
+		rwlock_acquire_write(rw);
+		return false;
+	}
+
+	/*
+	 * Upgrading is like being a waiting writer that jumps ahead of
+	 * the others: new readers stay out, and we take over as soon as
+	 * we're the only reader left.
+	 */
+	rw->rw_upgrading = true;
+	while (rw->rw_readers > 1) {
+		rwlock_sleep(rw, rw->rw_writewchan);
+	}
+	rw->rw_upgrading = false;
+	rw->rw_readers--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+	return true;
+}
+
+void
+rwlock_downgrade(struct rwlock *rw)
+{
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+	rw->rw_readers++;
+	/* Other readers may join us, unless a writer is waiting. */
+	if (rw->rw_writewait == 0) {
+		wchan_wakeall(rw->rw_readwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_write(struct rwlock *rw)
+{
+	return rw->rw_writer == curthread;
 }
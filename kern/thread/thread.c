@@ -49,14 +49,37 @@
 #include <synch.h>
 #include <addrspace.h>
 #include <mainbus.h>
+#include <clock.h>
 #include <vnode.h>
+#include <workqueue.h>
 
 #include "opt-synchprobs.h"
+#if OPT_SCHEDTRACE
+#include <schedtrace.h>
+#endif
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Multi-level feedback queue tuning. Quanta are in hardclocks, one
+ * per run queue level; lower-priority levels get longer slices. A
+ * thread that has waited SCHED_AGE_HARDCLOCKS on a run queue without
+ * running is moved up a level by schedule().
+ */
+static const unsigned sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+#define SCHED_AGE_HARDCLOCKS	20
+
+/* Work stealing, used by the idle loop; see below. */
+static bool thread_steal(void);
+
+/*
+ * Maximum number of dead threads each cpu keeps around for reuse by
+ * thread_fork. Each one holds on to a STACK_SIZE stack.
+ */
+#define THREAD_CACHE_MAX	8
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -112,26 +135,19 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Initialize (or reinitialize, for a recycled thread) everything in a
+ * thread structure except the stack and nap channel, which recycled
+ * threads keep.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_setup(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
@@ -139,7 +155,6 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -149,8 +164,50 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_priority = 0;
+	thread->t_inherit = SCHED_NOPRIO;
+	thread->t_quantum_used = 0;
+	thread->t_rq_stamp = 0;
+	thread->t_lastrun = 0;
+	thread->t_onrunqueue = false;
+	thread->t_cpumask = CPUMASK_ALL;
+#if OPT_SCHEDTRACE
+	thread->t_rq_ns = 0;
+	thread->t_run_ns = 0;
+#endif
+
+	/* Priority inheritance fields */
+	thread->t_blocked_on = NULL;
+	thread->t_heldlocks = NULL;
+
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_stack = NULL;
+	thread->t_napchan = NULL;
+	if (thread_setup(thread, name)) {
+		kfree(thread);
+		return NULL;
+	}
+
 	return thread;
 }
 
@@ -167,6 +224,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -179,20 +237,52 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_evicted);
 	c->c_hardclocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+		c->c_rq_maxlen[i] = 0;
+		c->c_rq_enqueued[i] = 0;
+	}
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
+	c->c_sched_demotions = 0;
+	c->c_sched_boosts = 0;
+	c->c_sched_promotions = 0;
+	c->c_migrations_in = 0;
+	c->c_migrations_out = 0;
+	c->c_yields_skipped = 0;
+	c->c_steal_attempts = 0;
+	c->c_steal_failures = 0;
+	c->c_steal_backoff = 0;
+	c->c_steal_next = 0;
+	threadlist_init(&c->c_threadcache);
+	c->c_tcache_hits = 0;
+	c->c_tcache_misses = 0;
+	c->c_tcache_overflows = 0;
+	c->c_tickless = 0;
+	c->c_idle_ticks = 0;
+	c->c_ticks_suppressed = 0;
+#if OPT_SCHEDTRACE
+	schedtrace_clear(&c->c_schedtrace);
+#endif
+#if OPT_MCSLOCK
+	c->c_mcsfree = (1U << MCS_NODES) - 1;
+#endif
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	spinlock_setname(&c->c_ipi_lock, "ipi");
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	/* Affinity masks have one bit per cpu. */
+	KASSERT(c->c_number < 32);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -252,6 +342,9 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
+	if (thread->t_napchan != NULL) {
+		wchan_destroy(thread->t_napchan);
+	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -262,9 +355,97 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Thread recycling.
+ *
+ * Rather than freeing a dead thread's structure and stack only for
+ * the next thread_fork to allocate and initialize them again, each
+ * cpu keeps up to THREAD_CACHE_MAX of them on c_threadcache. The
+ * stack guard band stays in place while cached.
+ *
+ * The cache is per-cpu and unlocked; interrupts are kept off while
+ * touching it so we can't be preempted and migrated halfway through.
+ */
+
+/*
+ * Put a zombie in the cache. Returns false if it can't be cached, in
+ * which case the caller should thread_destroy it.
+ */
+static
+bool
+thread_cache_put(struct thread *thread)
+{
+	int spl;
+
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL) {
+		/* boot stack; never freed or reused */
+		return false;
+	}
+
+	/* Check for room and take it in one go, so the cap holds. */
+	spl = splhigh();
+	if (curcpu->c_threadcache.tl_count >= THREAD_CACHE_MAX) {
+		curcpu->c_tcache_overflows++;
+		splx(spl);
+		return false;
+	}
+
+	/* Same as thread_destroy, minus the stack and the structure */
+	thread_checkstack(thread);
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread->t_wchan_name = "CACHED";
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	threadlist_addtail(&curcpu->c_threadcache, thread);
+	splx(spl);
+	return true;
+}
+
+/*
+ * Get a recycled thread, with stack, set up as if by thread_create.
+ * Returns NULL if the cache is empty.
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	if (thread == NULL) {
+		curcpu->c_tcache_misses++;
+	}
+	else {
+		curcpu->c_tcache_hits++;
+	}
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	KASSERT(thread->t_stack != NULL);
+	if (thread_setup(thread, name)) {
+		if (thread->t_napchan != NULL) {
+			wchan_destroy(thread->t_napchan);
+		}
+		kfree(thread->t_stack);
+		kfree(thread);
+		return NULL;
+	}
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) They are recycled if
+ * there's room in the thread cache.
  *
  * The list of zombies is per-cpu.
  */
@@ -277,7 +458,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_cache_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -289,6 +472,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +488,11 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -402,6 +589,7 @@ cpu_hatch(unsigned software_number)
 
 	kprintf("cpu%u: %s\n", software_number, cpu_identify());
 
+	workqueue_startcpu();
 	V(cpu_startup_sem);
 	thread_exit();
 }
@@ -415,6 +603,7 @@ thread_start_cpus(void)
 	unsigned i;
 
 	kprintf("cpu0: %s\n", cpu_identify());
+	workqueue_startcpu();
 
 	cpu_startup_sem = sem_create("cpu_hatch", 0);
 	mainbus_start_cpus();
@@ -426,10 +615,190 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The run queue is really SCHED_NLEVELS lists,
+ * one per priority level; threads are taken from the highest nonempty
+ * level and round-robin within a level. The cpu's runqueue lock must
+ * be held.
+ */
+
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	struct threadlist *tl;
+	unsigned level;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	level = thread_priority(t);
+	KASSERT(level < SCHED_NLEVELS);
+
+	tl = &c->c_runqueue[level];
+	threadlist_addtail(tl, t);
+	t->t_rq_stamp = c->c_hardclocks;
+	t->t_onrunqueue = true;
+
+	c->c_rq_enqueued[level]++;
+	if (tl->tl_count > c->c_rq_maxlen[level]) {
+		c->c_rq_maxlen[level] = tl->tl_count;
+	}
+}
+
+/* Take the next thread to run: from the highest nonempty level. */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			t = threadlist_remhead(&c->c_runqueue[i]);
+			t->t_onrunqueue = false;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, count;
+
+	count = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		count += c->c_runqueue[i].tl_count;
+	}
+	return count;
+}
+
+static
+bool
+runqueue_isempty(struct cpu *c)
+{
+	return runqueue_count(c) == 0;
+}
+
+#if OPT_SCHEDTRACE
+/*
+ * Latency tracing (see schedtrace.h). T is stamped when it's made
+ * runnable; when a cpu picks it, the wait since then goes in that
+ * cpu's and T's process's histograms, and when it switches away, so
+ * does the time it ran. Moving between run queues (stealing, priority
+ * changes) doesn't restart the wait. The cpu's runqueue lock must be
+ * held.
+ */
+static
+void
+schedtrace_enqueued(struct thread *t)
+{
+	t->t_rq_ns = schedtrace_enabled ? schedtrace_now() : 0;
+}
+
+static
+void
+schedtrace_descheduled(struct cpu *c, struct thread *t)
+{
+	uint64_t ns;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (t->t_run_ns != 0 && schedtrace_enabled) {
+		ns = schedtrace_now() - t->t_run_ns;
+		schedhist_add(&c->c_schedtrace.st_slice, ns);
+		if (t->t_proc != NULL) {
+			schedtrace_procrecord(t->t_proc->p_schedtrace,
+					      true, ns);
+		}
+	}
+	t->t_run_ns = 0;
+}
+
+static
+void
+schedtrace_scheduled(struct cpu *c, struct thread *t)
+{
+	uint64_t now, ns;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (!schedtrace_enabled) {
+		t->t_rq_ns = 0;
+		return;
+	}
+	now = schedtrace_now();
+	if (t->t_rq_ns != 0) {
+		ns = now - t->t_rq_ns;
+		schedhist_add(&c->c_schedtrace.st_wait, ns);
+		if (t->t_proc != NULL) {
+			schedtrace_procrecord(t->t_proc->p_schedtrace,
+					      false, ns);
+		}
+	}
+	t->t_rq_ns = 0;
+	t->t_run_ns = now;
+}
+#else
+#define schedtrace_enqueued(t)		((void)(t))
+#define schedtrace_descheduled(c, t)	((void)(c), (void)(t))
+#define schedtrace_scheduled(c, t)	((void)(c), (void)(t))
+#endif /* OPT_SCHEDTRACE */
+
+/*
+ * CPU affinity. Is T allowed to run on C?
+ */
+static
+bool
+thread_allowed(struct thread *t, struct cpu *c)
+{
+	return (t->t_cpumask & (1U << c->c_number)) != 0;
+}
+
+/*
+ * Choose a cpu for T that its mask allows: an idle one if there is
+ * one, otherwise the one with the shortest run queue. As in
+ * thread_steal, the queues are looked at without locking, as a hint.
+ */
+static
+struct cpu *
+thread_pick_cpu(struct thread *t)
+{
+	struct cpu *c, *best;
+	unsigned i, count, bestcount;
+
+	best = NULL;
+	bestcount = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!thread_allowed(t, c)) {
+			continue;
+		}
+		if (c->c_isidle) {
+			return c;
+		}
+		count = runqueue_count(c);
+		if (best == NULL || count < bestcount) {
+			best = c;
+			bestcount = count;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
 /*
  * Make a thread runnable.
  *
  * targetcpu might be curcpu; it might not be, too. 
+ *
+ * A thread coming off a wait channel has given up the cpu voluntarily
+ * and is probably interactive, so it gets moved up a level.
  */
 static
 void
@@ -447,10 +816,31 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 	else {
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		/*
+		 * If the thread may not run there, send it somewhere it
+		 * may. Not if that cpu is still on its stack, though
+		 * (see runqueue_steal); it'll be evicted from there
+		 * next time it yields.
+		 */
+		if (!thread_allowed(target, targetcpu) &&
+		    target != targetcpu->c_curthread) {
+			target->t_cpu = thread_pick_cpu(target);
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = target->t_cpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+		}
+	}
+
+	if (target->t_state == S_SLEEP && target->t_priority > 0) {
+		target->t_priority--;
+		target->t_quantum_used = 0;
+		targetcpu->c_sched_boosts++;
 	}
+	target->t_state = S_READY;
+	schedtrace_enqueued(target);
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -464,6 +854,35 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 }
 
+/*
+ * Move threads that thread_switch found on a cpu they may not run on
+ * to one they may. This has to wait until we've switched off the
+ * thread's stack, so it's called after each switch, like exorcise.
+ */
+static
+void
+thread_evict(void)
+{
+	struct cpu *c = curcpu->c_self;
+	struct thread *t;
+
+	while (1) {
+		/* thread_switch adds to the list with the lock held */
+		spinlock_acquire(&c->c_runqueue_lock);
+		t = threadlist_remhead(&c->c_evicted);
+		if (t == NULL) {
+			spinlock_release(&c->c_runqueue_lock);
+			break;
+		}
+		KASSERT(t != curthread);
+		KASSERT(t->t_state == S_READY);
+		/* t_cpu only changes under the old cpu's lock */
+		t->t_cpu = thread_pick_cpu(t);
+		spinlock_release(&c->c_runqueue_lock);
+		thread_make_runnable(t, false);
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -487,18 +906,22 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread if we can; it comes with a stack. */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -506,6 +929,7 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_cpumask = curthread->t_cpumask;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -570,21 +994,35 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* Cache affinity hint for work stealing. */
+	cur->t_lastrun = curcpu->c_hardclocks;
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && runqueue_isempty(curcpu)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
 	}
 
+	schedtrace_descheduled(curcpu, cur);
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		if (!thread_allowed(cur, curcpu->c_self)) {
+			/*
+			 * Its mask changed; it goes elsewhere once we've
+			 * switched away (which we will, since the run
+			 * queue isn't empty). See thread_setaffinity.
+			 */
+			threadlist_addtail(&curcpu->c_evicted, cur);
+			break;
+		}
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
@@ -613,8 +1051,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
-	 * curcpu->c_isidle must be true when md_idle is
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that idle (with the timer
+	 * deferred; see hardclock_idle).
+	 * curcpu->c_isidle must be true when hardclock_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
 	 *
@@ -632,14 +1072,19 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				/* Nap until the next steal attempt is due. */
+				hardclock_idle(curcpu->c_steal_next -
+					       curcpu->c_hardclocks);
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	schedtrace_scheduled(curcpu, next);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -711,8 +1156,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Activate our address space in the MMU. */
 	as_activate();
 
-	/* Clean up dead threads. */
+	/* Clean up dead threads, and send away barred ones. */
 	exorcise();
+	thread_evict();
 
 	/* Turn interrupts back on. */
 	splx(spl);
@@ -744,8 +1190,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Activate our address space in the MMU. */
 	as_activate();
 
-	/* Clean up dead threads. */
+	/* Clean up dead threads, and send away barred ones. */
 	exorcise();
+	thread_evict();
 
 	/* Enable interrupts. */
 	spl0();
@@ -822,83 +1269,370 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Threads start at level 0 and
+ * get sched_quantum[level] hardclocks before being preempted; a
+ * thread that uses up its whole quantum drops a level (see
+ * thread_timeslice), and one that sleeps on a wait channel moves up a
+ * level when woken (see thread_make_runnable). So CPU hogs sink and
+ * interactive threads float.
+ *
+ * schedule() is called periodically from hardclock() and does the
+ * aging: any thread that has sat on a lower-level run queue for
+ * SCHED_AGE_HARDCLOCKS is moved up one level, so hogs are not starved
+ * indefinitely. Each level is FIFO, so only the heads need checking.
  */
 
 void
 schedule(void)
 {
+	struct cpu *c = curcpu->c_self;
+	struct threadlist *tl;
+	struct thread *t;
+	unsigned i;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		tl = &c->c_runqueue[i];
+		while (!threadlist_isempty(tl)) {
+			t = tl->tl_head.tln_next->tln_self;
+			if (c->c_hardclocks - t->t_rq_stamp
+			    < SCHED_AGE_HARDCLOCKS) {
+				break;
+			}
+			threadlist_remhead(tl);
+			/* I may be a lent level; age the thread's own */
+			if (t->t_priority > 0) {
+				t->t_priority--;
+			}
+			t->t_quantum_used = 0;
+			runqueue_add(c, t);
+			c->c_sched_promotions++;
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+unsigned
+thread_priority(struct thread *t)
+{
+	return t->t_inherit < t->t_priority ? t->t_inherit : t->t_priority;
+}
+
+/*
+ * Change the level lent to T. If T is sitting on a run queue it has to
+ * move to the right one. T may be running, asleep, or queued on some
+ * cpu, and may be in the middle of being stolen by another cpu or
+ * waiting on c_evicted to be moved; in those cases it isn't on any
+ * run queue, and will be queued at the new level when it is.
+ */
+void
+thread_set_inherited(struct thread *t, unsigned level)
+{
+	struct cpu *c;
+	unsigned old;
+
+	KASSERT(level < SCHED_NLEVELS || level == SCHED_NOPRIO);
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * T can move between cpus until we hold the one it's on. Its
+	 * t_cpu only changes under the old cpu's runqueue lock, so once
+	 * we hold that and t_cpu still matches, it stays put.
 	 */
+	while (1) {
+		c = t->t_cpu;
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (t->t_cpu == c) {
+			break;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+	old = thread_priority(t);
+	t->t_inherit = level;
+	if (t->t_onrunqueue && thread_priority(t) != old) {
+		threadlist_remove(&c->c_runqueue[old], t);
+		runqueue_add(c, t);
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+void
+thread_setpriority(unsigned level)
+{
+	struct cpu *c;
+
+	KASSERT(level < SCHED_NLEVELS);
+
+	c = curcpu->c_self;
+	spinlock_acquire(&c->c_runqueue_lock);
+	curthread->t_priority = level;
+	curthread->t_quantum_used = 0;
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+uint32_t
+thread_getaffinity(void)
+{
+	return curthread->t_cpumask;
 }
 
 /*
- * Thread migration.
- *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
- *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Helper thread for thread_setaffinity; see below.
  */
+static
 void
-thread_consider_migration(void)
+thread_affinity_stub(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+}
+
+int
+thread_setaffinity(uint32_t mask)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	uint32_t oldmask, here;
+	unsigned ncpus;
+	int spl, result;
 
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
+	ncpus = cpuarray_num(&allcpus);
+	if (ncpus < 32) {
+		mask &= (1U << ncpus) - 1;
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	c = curcpu->c_self;
+	here = 1U << c->c_number;
+	if (mask & here) {
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
+		curthread->t_cpumask = mask;
 		spinlock_release(&c->c_runqueue_lock);
+		return 0;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
+	/*
+	 * We have to move. thread_switch does that when we yield, but
+	 * only once some other thread runs here, since until then
+	 * this cpu is using our stack. There may be nothing else to
+	 * run, so leave behind a thread that can only run here and
+	 * exits at once. (It comes from kproc, as it never goes to
+	 * userlevel.)
+	 *
+	 * Interrupts stay off until our new mask is set, so we can't be
+	 * preempted in between and let the stub run and exit while we
+	 * are still allowed here. Even so, if we come back on a cpu we
+	 * may not use, go round again rather than trust it.
+	 */
+	oldmask = curthread->t_cpumask;
+	do {
+		spl = splhigh();
+		here = 1U << curcpu->c_number;
+		curthread->t_cpumask = here;
+		result = thread_fork("affinity", kproc, thread_affinity_stub,
+				     NULL, 0);
+		curthread->t_cpumask = result ? oldmask : mask;
+		splx(spl);
+		if (result) {
+			return result;
+		}
+		thread_yield();
+	} while (!thread_allowed(curthread, curcpu->c_self));
+	return 0;
+}
+
+/*
+ * Time slicing. Called from hardclock() on every tick.
+ *
+ * Charge the tick to the current thread. If it has used up its
+ * quantum it is demoted a level and yields; it also yields early if a
+ * thread at a higher level is waiting. If nothing else is runnable it
+ * just starts a new quantum.
+ */
+void
+thread_timeslice(void)
+{
+	struct cpu *c = curcpu->c_self;
+	struct thread *cur = curthread;
+	bool preempt;
+	unsigned i;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (c->c_isidle) {
+		/* Interrupted the idle loop; nothing to charge. */
+		spinlock_release(&c->c_runqueue_lock);
 		return;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	preempt = false;
+	if (++cur->t_quantum_used >= sched_quantum[cur->t_priority]) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+			c->c_sched_demotions++;
+		}
+		cur->t_quantum_used = 0;
+		preempt = true;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	for (i=0; i<thread_priority(cur) && !preempt; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			preempt = true;
+		}
+	}
+	if (preempt && runqueue_isempty(c)) {
+		/* Nobody to yield to; don't bother switching. */
+		preempt = false;
+		c->c_yields_skipped++;
+	}
+	spinlock_release(&c->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Print run queue lengths and scheduler event counts for each cpu.
+ */
+void
+sched_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, j;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
+		spinlock_acquire(&c->c_runqueue_lock);
+		kprintf("cpu%u:\n", c->c_number);
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			kprintf("    level %u (quantum %u): %u queued, "
+				"max %u, %u enqueued\n", j, sched_quantum[j],
+				c->c_runqueue[j].tl_count,
+				c->c_rq_maxlen[j], c->c_rq_enqueued[j]);
 		}
+		kprintf("    %u demotions, %u wakeup boosts, "
+			"%u aging promotions\n", c->c_sched_demotions,
+			c->c_sched_boosts, c->c_sched_promotions);
+		kprintf("    migrations: %u in, %u out; steals: %u tried, "
+			"%u failed\n", c->c_migrations_in,
+			c->c_migrations_out, c->c_steal_attempts,
+			c->c_steal_failures);
+		kprintf("    thread cache: %u cached, %u hits, %u misses, "
+			"%u overflows\n", c->c_threadcache.tl_count,
+			c->c_tcache_hits, c->c_tcache_misses,
+			c->c_tcache_overflows);
+		kprintf("    idle: %u of %u ticks, %u ticks suppressed, "
+			"%u yields skipped\n", c->c_idle_ticks,
+			c->c_hardclocks, c->c_ticks_suppressed,
+			c->c_yields_skipped);
+		spinlock_release(&c->c_runqueue_lock);
+	}
+}
+
+#if OPT_SCHEDTRACE
+/*
+ * Print the latency histograms for each cpu, then each process. The
+ * copy is so we don't kprintf with the runqueue lock held.
+ */
+void
+sched_printtrace(void)
+{
+	static struct schedtrace snap;
+	struct cpu *c;
+	unsigned i;
+
+	kprintf("Scheduler latency tracing is %s\n",
+		schedtrace_enabled ? "on" : "off");
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
+		snap = c->c_schedtrace;
+		spinlock_release(&c->c_runqueue_lock);
+		kprintf("cpu%u:\n", c->c_number);
+		schedtrace_print(&snap);
+	}
+	schedtrace_procprint();
+}
+
+void
+sched_resettrace(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		schedtrace_clear(&c->c_schedtrace);
+		spinlock_release(&c->c_runqueue_lock);
+	}
+	schedtrace_procreset();
+}
+#endif /* OPT_SCHEDTRACE */
+
+/*
+ * Work stealing.
+ *
+ * Load balancing is pull-based: a cpu that runs out of work takes a
+ * thread from the run queue of the busiest peer. The idle loop in
+ * thread_switch tries this every time the cpu wakes up, and
+ * thread_consider_migration tries it periodically for a cpu that is
+ * busy but has nothing queued behind its current thread.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. So we prefer threads that have not run on the
+ * victim for SCHED_CACHE_HOT hardclocks, and only take a cache-hot one
+ * if the victim has a real backlog (more than SCHED_STEAL_HOT_MIN
+ * queued). System/161 does not (yet) model such cache effects, so the
+ * thresholds are deliberately small.
+ *
+ * Failed attempts back off exponentially (in hardclocks, up to
+ * SCHED_STEAL_MAXBACKOFF) so that a machine with several idle cpus and
+ * no work doesn't have them all continuously scanning each other.
+ */
+#define SCHED_CACHE_HOT		2
+#define SCHED_STEAL_HOT_MIN	2
+#define SCHED_STEAL_MAXBACKOFF	16
+
+/*
+ * Check the affinity hint: has T run on C recently? Only meaningful
+ * for a thread on C's run queue (t_lastrun is in C's hardclocks).
+ */
+static
+bool
+thread_is_cache_hot(struct thread *t, struct cpu *c)
+{
+	return c->c_hardclocks - t->t_lastrun < SCHED_CACHE_HOT;
+}
+
+/*
+ * Pick a thread for THIEF to steal from VICTIM's run queue, which must
+ * be locked, and remove it. Returns NULL if there isn't a suitable
+ * one. We look from the low-priority end, since those threads would
+ * wait longest where they are, and skip threads whose affinity mask
+ * doesn't include THIEF.
+ */
+static
+struct thread *
+runqueue_steal(struct cpu *victim, struct cpu *thief)
+{
+	struct threadlistnode *tln;
+	struct thread *t, *hot;
+	unsigned level, hotlevel;
+
+	KASSERT(spinlock_do_i_hold(&victim->c_runqueue_lock));
+
+	hot = NULL;
+	hotlevel = 0;
+	for (level = SCHED_NLEVELS; level-- > 0; ) {
+		for (tln = victim->c_runqueue[level].tl_tail.tln_prev;
+		     tln->tln_prev != NULL;
+		     tln = tln->tln_prev) {
+			t = tln->tln_self;
 			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
+			 * Ordinarily, the victim's curthread will not
+			 * appear on its run queue. However, it can
+			 * under the following circumstances:
 			 *   - it went to sleep;
 			 *   - the processor became idle, so it
 			 *     remained curthread;
@@ -907,54 +1641,132 @@ thread_consider_migration(void)
 			 *   - and the processor hasn't fully unidled
 			 *     yet, so all these things are still true.
 			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
+			 * *Migrating* such a thread can cause bad
+			 * things to happen (Exercise: Why? And what?)
+			 * so leave it alone.
 			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+			if (t == victim->c_curthread) {
 				continue;
 			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+			if (!thread_allowed(t, thief)) {
+				continue;
 			}
+			if (thread_is_cache_hot(t, victim)) {
+				if (hot == NULL) {
+					hot = t;
+					hotlevel = level;
+				}
+				continue;
+			}
+			threadlist_remove(&victim->c_runqueue[level], t);
+			t->t_onrunqueue = false;
+			return t;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
+	if (hot != NULL && runqueue_count(victim) > SCHED_STEAL_HOT_MIN) {
+		threadlist_remove(&victim->c_runqueue[hotlevel], hot);
+		hot->t_onrunqueue = false;
+		return hot;
+	}
+	return NULL;
+}
+
+/*
+ * Try to steal a thread from the busiest other cpu and put it on our
+ * own run queue. Returns true if we got one. Must be called without
+ * holding any run queue lock; we only ever hold one at a time, so
+ * cpus stealing from each other can't deadlock.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *self = curcpu->c_self;
+	struct cpu *c, *victim;
+	struct thread *t;
+	unsigned i, count, most;
+
+	if ((int)(self->c_hardclocks - self->c_steal_next) < 0) {
+		/* Still backing off from the last failure. */
+		return false;
+	}
+	self->c_steal_attempts++;
+
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * Find the busiest peer. Peek at the counts without locking;
+	 * this is only a hint and runqueue_steal checks again.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	victim = NULL;
+	most = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == self || c->c_isidle) {
+			continue;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+		count = runqueue_count(c);
+		if (count > most) {
+			most = count;
+			victim = c;
+		}
+	}
+
+	t = NULL;
+	if (victim != NULL) {
+		spinlock_acquire(&victim->c_runqueue_lock);
+		t = runqueue_steal(victim, self);
+		if (t != NULL) {
+			/* Move it while holding the lock it was under. */
+			t->t_cpu = self;
+			victim->c_migrations_out++;
+		}
+		spinlock_release(&victim->c_runqueue_lock);
 	}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	if (t == NULL) {
+		self->c_steal_failures++;
+		if (self->c_steal_backoff < SCHED_STEAL_MAXBACKOFF) {
+			self->c_steal_backoff = self->c_steal_backoff ?
+				self->c_steal_backoff * 2 : 1;
+		}
+		self->c_steal_next = self->c_hardclocks +
+			self->c_steal_backoff;
+		return false;
+	}
+	self->c_steal_backoff = 0;
+
+	DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, self->c_number);
+
+	spinlock_acquire(&self->c_runqueue_lock);
+	/* It's cold here, whatever it was there. */
+	t->t_lastrun = self->c_hardclocks - SCHED_CACHE_HOT;
+	runqueue_add(self, t);
+	self->c_migrations_in++;
+	spinlock_release(&self->c_runqueue_lock);
+
+	return true;
+}
+
+/*
+ * Thread migration.
+ *
+ * This is also called periodically from hardclock(). If nothing is
+ * waiting behind the current thread, try to pull work over from a
+ * busier cpu.
+ */
+void
+thread_consider_migration(void)
+{
+	bool empty;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	empty = runqueue_isempty(curcpu->c_self);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (empty) {
+		thread_steal();
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -981,6 +1793,7 @@ wchan_create(const char *name)
 		return NULL;
 	}
 	spinlock_init(&wc->wc_lock);
+	spinlock_setname(&wc->wc_lock, name);
 	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
@@ -1106,6 +1919,52 @@ wchan_isempty(struct wchan *wc)
 	return ret;
 }
 
+unsigned
+wchan_requeue(struct wchan *from, struct wchan *to, bool all)
+{
+	struct thread *t;
+	unsigned moved;
+
+	KASSERT(from != to);
+
+	moved = 0;
+	spinlock_acquire(&from->wc_lock);
+	spinlock_acquire(&to->wc_lock);
+	while ((t = threadlist_remhead(&from->wc_threads)) != NULL) {
+		t->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, t);
+		moved++;
+		if (!all) {
+			break;
+		}
+	}
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+
+	return moved;
+}
+
+unsigned
+wchan_priority(struct wchan *wc)
+{
+	struct threadlistnode *tln;
+	unsigned best, level;
+
+	best = SCHED_NOPRIO;
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next;
+	     tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		level = thread_priority(tln->tln_self);
+		if (level < best) {
+			best = level;
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	return best;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1162,6 +2021,20 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+		}
+	}
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -0,0 +1,267 @@
+/*
+ * Deferred work. See workqueue.h.
+ *
+ * One spinlock covers all the queues and the state of every work item.
+ * It is only held to link and unlink items, never while one runs, so
+ * the workers still run in parallel; and it means an item's pending
+ * flag and queue can't change under us while we look at them.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <proc.h>
+#include <workqueue.h>
+
+#define WORKQUEUE_MAXCPUS	32	/* cpu_create allows no more */
+
+struct workqueue {
+	unsigned wq_cpunum;
+	struct work *wq_head;		/* Queued items, in order */
+	struct work *wq_tail;
+	struct work *wq_running;	/* Item being run, or NULL */
+	unsigned wq_runningseq;		/* Its w_seq */
+	unsigned wq_seq;		/* Last w_seq handed out */
+	struct wchan *wq_wchan;		/* Worker sleeps here */
+	struct wchan *wq_flushchan;	/* Flushers sleep here */
+};
+
+static struct workqueue *workqueues[WORKQUEUE_MAXCPUS];
+static struct spinlock workqueue_lock =
+	SPINLOCK_NAMED_INITIALIZER("workqueue");
+
+/* True if sequence number A comes after B (they wrap). */
+#define WORKSEQ_AFTER(a, b)	((int)((a) - (b)) > 0)
+
+void
+work_init(struct work *w, void (*func)(void *, unsigned long),
+	  void *data1, unsigned long data2)
+{
+	w->w_func = func;
+	w->w_data1 = data1;
+	w->w_data2 = data2;
+	w->w_next = NULL;
+	w->w_wq = NULL;
+	w->w_seq = 0;
+	w->w_pending = false;
+}
+
+bool
+work_queue_on(struct work *w, unsigned cpunum)
+{
+	struct workqueue *wq;
+
+	KASSERT(cpunum < WORKQUEUE_MAXCPUS);
+	wq = workqueues[cpunum];
+	KASSERT(wq != NULL);
+
+	spinlock_acquire(&workqueue_lock);
+	if (w->w_pending) {
+		spinlock_release(&workqueue_lock);
+		return false;
+	}
+	w->w_next = NULL;
+	w->w_wq = wq;
+	w->w_seq = ++wq->wq_seq;
+	w->w_pending = true;
+	if (wq->wq_tail == NULL) {
+		wq->wq_head = w;
+	}
+	else {
+		wq->wq_tail->w_next = w;
+	}
+	wq->wq_tail = w;
+	wchan_wakeone(wq->wq_wchan);
+	spinlock_release(&workqueue_lock);
+	return true;
+}
+
+bool
+work_queue(struct work *w)
+{
+	return work_queue_on(w, curcpu->c_number);
+}
+
+bool
+work_cancel(struct work *w)
+{
+	struct workqueue *wq;
+	struct work **pw, *prev;
+
+	spinlock_acquire(&workqueue_lock);
+	if (!w->w_pending) {
+		spinlock_release(&workqueue_lock);
+		return false;
+	}
+	wq = w->w_wq;
+	prev = NULL;
+	for (pw = &wq->wq_head; *pw != w; pw = &(*pw)->w_next) {
+		KASSERT(*pw != NULL);
+		prev = *pw;
+	}
+	*pw = w->w_next;
+	if (wq->wq_tail == w) {
+		wq->wq_tail = prev;
+	}
+	w->w_next = NULL;
+	w->w_pending = false;
+	/* Someone may be flushing it. */
+	wchan_wakeall(wq->wq_flushchan);
+	spinlock_release(&workqueue_lock);
+	return true;
+}
+
+void
+work_flush(struct work *w)
+{
+	struct workqueue *wq;
+
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&workqueue_lock);
+	while (1) {
+		wq = w->w_wq;
+		if (wq == NULL || (!w->w_pending && wq->wq_running != w)) {
+			break;
+		}
+		wchan_lock(wq->wq_flushchan);
+		spinlock_release(&workqueue_lock);
+		wchan_sleep(wq->wq_flushchan);
+		spinlock_acquire(&workqueue_lock);
+	}
+	spinlock_release(&workqueue_lock);
+}
+
+/*
+ * Wait for each queue in turn until nothing that was on it when we
+ * started (seq at or before the one we saw) is queued or running.
+ * The queues are FIFO, so it's enough to look at the head.
+ */
+void
+workqueue_flush(void)
+{
+	struct workqueue *wq;
+	unsigned i, seq;
+
+	KASSERT(curthread->t_in_interrupt == false);
+
+	for (i=0; i<WORKQUEUE_MAXCPUS; i++) {
+		wq = workqueues[i];
+		if (wq == NULL) {
+			continue;
+		}
+		spinlock_acquire(&workqueue_lock);
+		seq = wq->wq_seq;
+		while ((wq->wq_head != NULL &&
+			!WORKSEQ_AFTER(wq->wq_head->w_seq, seq)) ||
+		       (wq->wq_running != NULL &&
+			!WORKSEQ_AFTER(wq->wq_runningseq, seq))) {
+			wchan_lock(wq->wq_flushchan);
+			spinlock_release(&workqueue_lock);
+			wchan_sleep(wq->wq_flushchan);
+			spinlock_acquire(&workqueue_lock);
+		}
+		spinlock_release(&workqueue_lock);
+	}
+}
+
+/*
+ * The worker. Copies out what it needs before calling the function,
+ * because the function may free or requeue the item.
+ */
+static
+void
+workqueue_worker(void *data1, unsigned long junk)
+{
+	struct workqueue *wq = data1;
+	struct work *w;
+	void (*func)(void *, unsigned long);
+	void *fdata1;
+	unsigned long fdata2;
+
+	(void)junk;
+
+	spinlock_acquire(&workqueue_lock);
+	while (1) {
+		w = wq->wq_head;
+		if (w == NULL) {
+			wchan_lock(wq->wq_wchan);
+			spinlock_release(&workqueue_lock);
+			wchan_sleep(wq->wq_wchan);
+			spinlock_acquire(&workqueue_lock);
+			continue;
+		}
+
+		wq->wq_head = w->w_next;
+		if (wq->wq_head == NULL) {
+			wq->wq_tail = NULL;
+		}
+		w->w_next = NULL;
+		w->w_pending = false;
+		wq->wq_running = w;
+		wq->wq_runningseq = w->w_seq;
+		func = w->w_func;
+		fdata1 = w->w_data1;
+		fdata2 = w->w_data2;
+		spinlock_release(&workqueue_lock);
+
+		func(fdata1, fdata2);
+
+		spinlock_acquire(&workqueue_lock);
+		wq->wq_running = NULL;
+		wchan_wakeall(wq->wq_flushchan);
+	}
+}
+
+/*
+ * Set up the current cpu's queue and start its worker, pinned to this
+ * cpu. Called by each cpu as it starts up, from a thread that's about
+ * to exit or (on the boot cpu) that puts its affinity back afterward.
+ */
+void
+workqueue_startcpu(void)
+{
+	struct workqueue *wq;
+	unsigned num;
+	uint32_t mask;
+	char name[16];
+	int result;
+
+	num = curcpu->c_number;
+	KASSERT(num < WORKQUEUE_MAXCPUS);
+	KASSERT(workqueues[num] == NULL);
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		panic("workqueue_startcpu: Out of memory\n");
+	}
+	wq->wq_cpunum = num;
+	wq->wq_head = wq->wq_tail = NULL;
+	wq->wq_running = NULL;
+	wq->wq_runningseq = 0;
+	wq->wq_seq = 0;
+	wq->wq_wchan = wchan_create("workq");
+	wq->wq_flushchan = wchan_create("workq_flush");
+	if (wq->wq_wchan == NULL || wq->wq_flushchan == NULL) {
+		panic("workqueue_startcpu: Out of memory\n");
+	}
+	workqueues[num] = wq;
+
+	/*
+	 * New threads start on the current cpu with the current
+	 * thread's affinity, so pinning ourselves pins the worker.
+	 */
+	mask = curthread->t_cpumask;
+	curthread->t_cpumask = 1U << num;
+	snprintf(name, sizeof(name), "workq%u", num);
+	result = thread_fork(name, kproc, workqueue_worker, wq, 0);
+	curthread->t_cpumask = mask;
+	if (result) {
+		panic("workqueue_startcpu: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
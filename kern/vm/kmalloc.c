@@ -195,7 +195,7 @@ static struct pageref *allbase;
  * OS/161 performance and scalability aren't super-critical.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock = SPINLOCK_NAMED_INITIALIZER("kmalloc");
 
 ////////////////////////////////////////
 
@@ -345,6 +345,8 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kvm_printstats();
 }
 
 ////////////////////////////////////////
@@ -608,6 +610,14 @@ kmalloc(size_t sz)
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
+		if (address==0 && npages > 1) {
+			/*
+			 * No physically contiguous run; map scattered
+			 * frames in kseg2 instead. Single pages (which
+			 * includes thread stacks) always stay in kseg0.
+			 */
+			address = alloc_kvpages(npages);
+		}
 		if (address==0) {
 			return NULL;
 		}
@@ -626,6 +636,8 @@ kfree(void *ptr)
 	 */
 	if (ptr == NULL) {
 		return;
+	} else if (kvm_isaddr((vaddr_t)ptr)) {
+		free_kvpages((vaddr_t)ptr);
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
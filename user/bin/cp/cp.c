@@ -36,28 +36,14 @@
  */
 
 
-/* Copy one file to another. */
+/* Copy the rest of FROMFD to TOFD through a buffer. */
 static
 void
-copy(const char *from, const char *to)
+copyrw(const char *from, int fromfd, const char *to, int tofd)
 {
-	int fromfd;
-	int tofd;
 	char buf[1024];
 	int len, wr, wrtot;
 
-	/*
-	 * Open the files, and give up if they won't open
-	 */
-	fromfd = open(from, O_RDONLY);
-	if (fromfd<0) {
-		err(1, "%s", from);
-	}
-	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
-	if (tofd<0) {
-		err(1, "%s", to);
-	}
-
 	/*
 	 * As long as we get more than zero bytes, we haven't hit EOF.
 	 * Zero means EOF. Less than zero means an error occurred.
@@ -84,6 +70,44 @@ copy(const char *from, const char *to)
 	if (len<0) {
 		err(1, "%s", from);
 	}
+}
+
+/* Copy one file to another. */
+static
+void
+copy(const char *from, const char *to)
+{
+	int fromfd;
+	int tofd;
+	int len;
+
+	/*
+	 * Open the files, and give up if they won't open
+	 */
+	fromfd = open(from, O_RDONLY);
+	if (fromfd<0) {
+		err(1, "%s", from);
+	}
+	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
+	if (tofd<0) {
+		err(1, "%s", to);
+	}
+
+	/*
+	 * Have the kernel move the data, as much as it likes at a time,
+	 * without it coming through here. Zero means EOF.
+	 *
+	 * Less than zero means an error occurred, but not on which
+	 * file. Anything copied so far stays copied and both offsets
+	 * are past it, so finish with read and write, which will hit
+	 * the same error and let us say which file it was.
+	 */
+	while ((len = copy_file_range(fromfd, tofd, 0x7fffffff))>0) {
+		/* nothing */
+	}
+	if (len<0) {
+		copyrw(from, fromfd, to, tofd);
+	}
 
 	if (close(fromfd) < 0) {
 		err(1, "%s: close", from);
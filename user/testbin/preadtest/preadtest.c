@@ -0,0 +1,137 @@
+/*
+ * preadtest.c
+ *
+ * 	Tests pread and pwrite on a user specified file: that they work
+ * 	at the position given, below and above 4 GiB (the position is
+ * 	64 bits, passed partly on the stack), that they leave the file's
+ * 	seek position alone, and that they fail with ESPIPE on the
+ * 	console.
+ *
+ * Like filetest, this will not run fully on emufs, because emufs does
+ * not support remove().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define HIGHPOS		(((off_t)1 << 32) + 2)
+
+static
+void
+checkpos(int fd, off_t expected, const char *when)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos<0) {
+		err(1, "lseek");
+	}
+	if (pos != expected) {
+		errx(1, "Seek position %lld after %s, expected %lld",
+		     (long long)pos, when, (long long)expected);
+	}
+}
+
+static
+void
+checkdata(int fd, off_t pos, const char *expected, const char *when)
+{
+	char buf[16];
+	size_t len;
+	int rv;
+
+	len = strlen(expected);
+	rv = pread(fd, buf, sizeof(buf), pos);
+	if (rv<0) {
+		err(1, "pread at %lld after %s", (long long)pos, when);
+	}
+	if ((size_t)rv != len || memcmp(buf, expected, len)) {
+		errx(1, "Data mismatch at %lld after %s", (long long)pos,
+		     when);
+	}
+}
+
+static
+void
+checkfail(int rv, int expected, const char *what)
+{
+	if (rv>=0) {
+		errx(1, "%s succeeded, expected failure", what);
+	}
+	if (errno != expected) {
+		errx(1, "%s failed with %s, expected %s", what,
+		     strerror(errno), strerror(expected));
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	char buf[4];
+	int fd, rv;
+
+	if (argc!=2) {
+		errx(1, "Usage: preadtest <filename>");
+	}
+
+	fd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd<0) {
+		err(1, "%s: open", argv[1]);
+	}
+	rv = write(fd, "abcdefghij", 10);
+	if (rv != 10) {
+		err(1, "%s: write", argv[1]);
+	}
+
+	/* Below 4 GiB. */
+	rv = pwrite(fd, "XY", 2, 3);
+	if (rv != 2) {
+		err(1, "%s: pwrite", argv[1]);
+	}
+	checkpos(fd, 10, "pwrite");
+	checkdata(fd, 0, "abcXYfghij", "pwrite");
+	checkpos(fd, 10, "pread");
+	checkdata(fd, 10, "", "pread at EOF");
+
+	/*
+	 * Above 4 GiB. The file system may not go that far; if it
+	 * does, the data must be there and not at HIGHPOS's low word.
+	 */
+	rv = pwrite(fd, "QQ", 2, HIGHPOS);
+	if (rv<0) {
+		warn("%s: pwrite above 4 GiB (skipping that part)", argv[1]);
+	}
+	else if (rv != 2) {
+		errx(1, "%s: short pwrite above 4 GiB", argv[1]);
+	}
+	else {
+		checkdata(fd, HIGHPOS, "QQ", "pwrite above 4 GiB");
+	}
+	checkdata(fd, 0, "abcXYfghij", "pwrite above 4 GiB");
+	checkpos(fd, 10, "pwrite above 4 GiB");
+
+	rv = pread(fd, buf, sizeof(buf), -1);
+	checkfail(rv, EINVAL, "pread at -1");
+	rv = pwrite(fd, buf, sizeof(buf), -1);
+	checkfail(rv, EINVAL, "pwrite at -1");
+
+	/* The console can't seek. */
+	rv = pread(STDIN_FILENO, buf, sizeof(buf), 0);
+	checkfail(rv, ESPIPE, "pread on the console");
+	rv = pwrite(STDOUT_FILENO, buf, sizeof(buf), 0);
+	checkfail(rv, ESPIPE, "pwrite on the console");
+
+	rv = close(fd);
+	if (rv<0) {
+		err(1, "%s: close", argv[1]);
+	}
+	rv = remove(argv[1]);
+	if (rv<0) {
+		err(1, "%s: remove", argv[1]);
+	}
+	printf("Passed preadtest.\n");
+	return 0;
+}
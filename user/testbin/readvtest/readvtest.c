@@ -0,0 +1,145 @@
+/*
+ * readvtest.c
+ *
+ * 	Tests readv and writev on a user specified file: gathering and
+ * 	scattering across several fragments, some of them empty, and
+ * 	the EINVAL cases (no iovecs, more than IOV_MAX, and a total
+ * 	length that doesn't fit in the return value).
+ *
+ * Like filetest, this will not run fully on emufs, because emufs does
+ * not support remove().
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+static const char *const pieces[] = {
+	"Twiddle dee dee, ", "", "Twiddle ", "dum dum.......\n",
+};
+#define NPIECES (sizeof(pieces) / sizeof(pieces[0]))
+
+static struct iovec iov[IOV_MAX + 1];
+
+static
+void
+checkfail(int rv, int expected, const char *what)
+{
+	if (rv>=0) {
+		errx(1, "%s succeeded, expected failure", what);
+	}
+	if (errno != expected) {
+		errx(1, "%s failed with %s, expected %s", what,
+		     strerror(errno), strerror(expected));
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static char expected[64];
+	static char readbuf[64];
+	size_t total;
+	unsigned i;
+	int fd, rv;
+
+	if (argc!=2) {
+		errx(1, "Usage: readvtest <filename>");
+	}
+
+	fd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd<0) {
+		err(1, "%s: open", argv[1]);
+	}
+
+	/* Gather: the pieces (one empty), then an empty NULL iovec. */
+	total = 0;
+	expected[0] = 0;
+	for (i=0; i<NPIECES; i++) {
+		iov[i].iov_base = (void *)pieces[i];
+		iov[i].iov_len = strlen(pieces[i]);
+		strcat(expected, pieces[i]);
+		total += iov[i].iov_len;
+	}
+	iov[NPIECES].iov_base = NULL;
+	iov[NPIECES].iov_len = 0;
+	rv = writev(fd, iov, NPIECES + 1);
+	if (rv<0) {
+		err(1, "%s: writev", argv[1]);
+	}
+	if ((size_t)rv != total) {
+		errx(1, "writev wrote %d bytes, expected %u", rv,
+		     (unsigned)total);
+	}
+
+	/* Scatter into uneven fragments, again with an empty one. */
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", argv[1]);
+	}
+	iov[0].iov_base = readbuf;
+	iov[0].iov_len = 5;
+	iov[1].iov_base = readbuf + 5;
+	iov[1].iov_len = 0;
+	iov[2].iov_base = readbuf + 5;
+	iov[2].iov_len = 11;
+	iov[3].iov_base = readbuf + 16;
+	iov[3].iov_len = sizeof(readbuf) - 17;
+	rv = readv(fd, iov, 4);
+	if (rv<0) {
+		err(1, "%s: readv", argv[1]);
+	}
+	if ((size_t)rv != total) {
+		errx(1, "readv read %d bytes, expected %u", rv,
+		     (unsigned)total);
+	}
+	readbuf[total] = 0;
+	if (strcmp(readbuf, expected)) {
+		errx(1, "Buffer data mismatch!");
+	}
+
+	/* At EOF now. */
+	rv = readv(fd, iov, 4);
+	if (rv != 0) {
+		errx(1, "readv at EOF returned %d", rv);
+	}
+
+	/* Bad counts. */
+	for (i=0; i<IOV_MAX + 1; i++) {
+		iov[i].iov_base = readbuf;
+		iov[i].iov_len = 0;
+	}
+	rv = readv(fd, iov, 0);
+	checkfail(rv, EINVAL, "readv of 0 iovecs");
+	rv = writev(fd, iov, 0);
+	checkfail(rv, EINVAL, "writev of 0 iovecs");
+	rv = readv(fd, iov, IOV_MAX + 1);
+	checkfail(rv, EINVAL, "readv of IOV_MAX+1 iovecs");
+	rv = writev(fd, iov, IOV_MAX + 1);
+	checkfail(rv, EINVAL, "writev of IOV_MAX+1 iovecs");
+	rv = readv(fd, iov, IOV_MAX);
+	if (rv != 0) {
+		errx(1, "readv of IOV_MAX empty iovecs returned %d", rv);
+	}
+
+	/* A total that doesn't fit in an int. */
+	iov[0].iov_len = 0x7fffffff;
+	iov[1].iov_len = 1;
+	rv = readv(fd, iov, 2);
+	checkfail(rv, EINVAL, "readv of more than INT_MAX bytes");
+	rv = writev(fd, iov, 2);
+	checkfail(rv, EINVAL, "writev of more than INT_MAX bytes");
+
+	rv = close(fd);
+	if (rv<0) {
+		err(1, "%s: close", argv[1]);
+	}
+	rv = remove(argv[1]);
+	if (rv<0) {
+		err(1, "%s: remove", argv[1]);
+	}
+	printf("Passed readvtest.\n");
+	return 0;
+}